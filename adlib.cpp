@@ -1,105 +1,90 @@
-#include <math.h>
 #include <memory.h>
+#include <chrono>
 
-typedef unsigned char 	uint8;
-typedef signed char		int8;
-typedef unsigned short	uint16;
-typedef signed short	int16;
-typedef unsigned int 	uint32;
-typedef signed int		int32;
-
-#define NUM_MIDI_CHANNELS		15
-
-struct MidiChannel {
-	uint8 program;
-	uint8 volume;
-	uint8 pedal;
-} midi_channels[NUM_MIDI_CHANNELS];
-
-enum DriverStatus {
-	kStatusStopped,
-	kStatusPlaying,
-	kStatusPaused
-};
-
-DriverStatus driver_status;
-bool driver_installed;
-
-uint32 midi_buffer_pos;
-
-uint16 midi_division;	// in ppqn
-uint16 midi_event_delta;
-uint8  midi_event_type, last_midi_event_type;
-uint8  midi_tempo;
-uint8  midi_event_channel;
-uint8  midi_onoff_note;
-uint8  midi_onoff_velocity;
-int16 midi_pitch_bend;
-uint8 midi_fade_volume_change_rate;
-
-// set by the client
-uint32 midi_buffer_size;
-bool midi_loop;
-uint8 midi_volume;	// coarse volume
-bool midi_fade_out_flag;
-bool midi_fade_in_flag;
-
-
-// fade in
-bool driver_fading_in;
-uint32 fadein_volume_cur;
-uint32 fadein_volume_inc;
-
-// fade out
-bool driver_fading_out;
-uint32 fadeout_volume_cur;
-uint32 fadeout_volume_dec;
-
-uint32 driver_lin_volume[128];
-
-// internal fine volume
-uint16 full_volume;
+#include "adlib.h"
+#include "trace.h"
 
 #define COARSE_VOL(x)	((x)>>8)
 #define FINE_VOL(x)		((x)<<8)
 
 /**********************************
-	prototypes
+	volume tables, built by the compiler
 */
 
-// midi driver
-uint8 read_midi_byte();
-uint16 read_midi_word();
-uint32 read_midi_VLQ();
-void midi_fadeout_and_stop();
-void midi_stop();
-void midi_pause();
-void midi_resume();
-void midi_set_tempo();
-void process_midi_meta_event();
-void process_midi_channel_event();
-void process_meta_tempo_event();
-
-// timers
-
-void set_hw_timer(uint16 clock);
-void reset_hw_timer();
-
-// OPL
-void ADLIB_init();
-void ADLIB_tick();
-void ADLIB_init_voices();
-void ADLIB_mute_voices();
-void ADLIB_turn_on_voice();
-void ADLIB_turn_off_voice();
-void ADLIB_pitch_bend(int amount, uint8 midi_channel);
-void ADLIB_modulation(int value);
+// natural logarithm, good to the last bit of a double for the small arguments used here
+static constexpr double ADLIB_ln(double x) {
+	int exponent = 0;
+	while (x >= 2.0) {
+		x /= 2.0;
+		exponent++;
+	}
+	// ln(x) = 2 atanh((x-1)/(x+1)), with (x-1)/(x+1) < 1/3
+	double z = (x - 1.0) / (x + 1.0);
+	double term = z;
+	double sum = 0.0;
+	for (int n = 1; n < 60; n += 2) {
+		sum += term / n;
+		term *= z * z;
+	}
+	return 2.0 * sum + exponent * 0.69314718055994530942;
+}
+
+struct VolumeTables {
+	uint32 lin[128];
+	uint32 log[129];
+
+	constexpr VolumeTables() : lin(), log() {
+		// linear map [0..127] to [0..128] (user volume to driver volume?)
+		for (int i = 0; i < 128; ++i) {
+			lin[i] = (256 * i + 127) / 254;		// round(i * 128 / 127)
+		}
+		// logarithmic map [0 -> 0, 1..128 -> 1..256] (driver volume to hw volume?)
+		for (int i = 0; i < 129; ++i) {
+			log[i] = (uint32)(256.0 * (ADLIB_ln(i + 1.0) / ADLIB_ln(128.0)) + 0.5);
+		}
+	}
+};
+
+static constexpr VolumeTables volume_tables;
+static constexpr const uint32 (&driver_lin_volume)[128] = volume_tables.lin;
+static constexpr const uint32 (&ADLIB_log_volume)[129] = volume_tables.log;
 
 /**********************************
 	msc-midi driver
 */
 
-void midi_driver() {
+AdlibDriver::AdlibDriver(AdlibBackend *backend, bool opl3) :
+	driver_status(kStatusStopped),
+	driver_installed(false),
+	opl3(opl3),
+	melodic_voices(opl3 ? MAX_MELODIC_VOICES : NUM_MELODIC_VOICES),
+	midi_buffer(0),
+	midi_buffer_size(0),
+	stats_timing(false),
+	backend(backend),
+	midi_smf(false),
+	midi_track_cursors(false),
+	midi_source(0),
+	snapshot_sequence(0) {
+	voice_free_mask = 0;
+	driver_percussion_mask = 0;	// ADLIB_init() sends it to the chip
+	driver_timestamp = 0;
+	driver_assigned_voice = 0;
+	midi_loaded_buffer = 0;
+	midi_loaded_size = 0;
+	midi_fast_forwarding = false;
+	midi_reset_stats();
+	for (uint32 i = 0; i < sizeof(snapshot_words) / 4; ++i) {
+		snapshot_words[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void AdlibDriver::midi_process_events() {
+	if (!driver_installed || driver_status != kStatusPlaying) {
+		return;
+	}
+	midi_position++;
+
 	while (true) {
 
 		if (!driver_installed) {
@@ -109,12 +94,14 @@ void midi_driver() {
 			return;
 		}
 		
-		if (midi_buffer_pos < midi_buffer_size) {
+		const MidiEvent *next = midi_peek_event();
+		if (next) {
 			// playback
 			if (driver_fading_in) {
 				if (full_volume > COARSE_VOL(fadein_volume_cur)) {
 					fadein_volume_cur += fadein_volume_inc;
 					midi_volume = COARSE_VOL(fadein_volume_cur);
+					stats.fade_steps++;
 				} else {
 					driver_fading_in = false;
 					midi_volume = full_volume;
@@ -126,6 +113,7 @@ void midi_driver() {
 				if (0 < COARSE_VOL(fadeout_volume_cur)) {
 					fadeout_volume_cur -= fadeout_volume_dec;
 					midi_volume = COARSE_VOL(fadeout_volume_cur);
+					stats.fade_steps++;
 				} else {
 					driver_fading_out = false;
 					midi_volume = full_volume;
@@ -143,30 +131,22 @@ void midi_driver() {
 				break; // return
 			}
 
-			if (midi_event_type == 255) {
-				process_midi_meta_event();
-				midi_event_delta = read_midi_word();
-				midi_event_type = read_midi_byte();			
-			} else {
-				if ((midi_event_type & 0x80) == 0) {
-					// repeat the last event
-					midi_buffer_pos--;
-					midi_event_type = last_midi_event_type;
-				}
-			
-				process_midi_channel_event();
-				last_midi_event_type = midi_event_type;
-				midi_event_delta = read_midi_word();
-				midi_event_type = read_midi_byte();				
+			MidiEvent event = *next;
+			midi_pop_event();
+			process_midi_event(&event);
+			stats.events++;
+			next = midi_peek_event();
+			if (next) {
+				midi_event_delta = next->tick - event.tick;
 			}
 
 		} else {
 			// end-of-file
-			if (midi_loop) {
-				// loop the file from the beginning
-				midi_buffer_pos = 7;	// skip signature and a couple of fields
-				midi_event_delta = read_midi_word();
-				midi_event_type = read_midi_byte();
+			if (midi_loop && midi_rewind()) {
+				// loop the song from the beginning
+				midi_event_delta = midi_peek_event()->tick;
+				midi_position = 0;
+				midi_loops++;
 			} else {
 				midi_stop();
 				break;	// return
@@ -175,7 +155,130 @@ void midi_driver() {
 	}
 }
 
-void midi_fadeout_and_stop() {
+void AdlibDriver::midi_driver() {
+	ADLIB_TRACE_POINT(kTraceTickBegin, 0, midi_position);
+
+	std::chrono::steady_clock::time_point start;
+	if (stats_timing) {
+		start = std::chrono::steady_clock::now();
+	}
+
+	midi_process_events();
+	
+	// send the register writes of this tick to the chip in one go
+	ADLIB_flush();
+
+	if (stats_timing) {
+		uint32 ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		stats.timed_ticks++;
+		stats.tick_ns_total += ns;
+		if (ns > stats.tick_ns_max) {
+			stats.tick_ns_max = ns;
+		}
+	}
+
+	midi_publish_snapshot();
+
+	ADLIB_TRACE_POINT(kTraceTickEnd, 0, midi_position);
+}
+
+void AdlibDriver::midi_publish_snapshot() {
+	DriverSnapshot snapshot;
+	uint32 words[sizeof(snapshot_words) / 4];
+
+	if (midi_fast_forwarding) {
+		return;	// readers only see where the seek lands
+	}
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.position = midi_position;
+	snapshot.length = midi_length;
+	snapshot.status = driver_status;
+	snapshot.volume = midi_volume;
+	snapshot.fade_in_flag = midi_fade_in_flag;
+	snapshot.fade_out_flag = midi_fade_out_flag;
+	snapshot.fading = driver_fading_in ? 1 : (driver_fading_out ? 2 : 0);
+	snapshot.fade_rate = midi_fade_volume_change_rate;
+	snapshot.tempo = midi_tempo;
+	snapshot.loop = midi_loop;
+	for (int i = 0; i < NUM_MIDI_CHANNELS; ++i) {
+		snapshot.programs[i] = midi_channels[i].program;
+	}
+
+	// count the keys that are on in the chip
+	snapshot.active_voices = __builtin_popcount(~voice_free_mask & ((1 << melodic_voices) - 1));
+	for (int i = 0; i < NUM_PERCUSSIONS; ++i) {
+		snapshot.active_voices += (ADLIB_registers[0xBD] >> i) & 1;
+	}
+	snapshot.stats = stats;
+
+	memset(words, 0, sizeof(words));
+	memcpy(words, &snapshot, sizeof(snapshot));
+
+	uint32 sequence = snapshot_sequence.load(std::memory_order_relaxed);
+	snapshot_sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for (uint32 i = 0; i < sizeof(words) / 4; ++i) {
+		snapshot_words[i].store(words[i], std::memory_order_relaxed);
+	}
+	snapshot_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void AdlibDriver::midi_reset_stats() {
+	memset(&stats, 0, sizeof(stats));
+}
+
+/* Copies the last published snapshot. Readers never block the driver: they retry if a tick published
+   a new snapshot while they were copying it. */
+void AdlibDriver::midi_read_snapshot(DriverSnapshot *snapshot) const {
+	uint32 words[sizeof(snapshot_words) / 4];
+	uint32 sequence;
+
+	do {
+		sequence = snapshot_sequence.load(std::memory_order_acquire);
+		for (uint32 i = 0; i < sizeof(words) / 4; ++i) {
+			words[i] = snapshot_words[i].load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while ((sequence & 1) || sequence != snapshot_sequence.load(std::memory_order_relaxed));
+
+	memcpy(snapshot, words, sizeof(*snapshot));
+}
+
+/* number of upcoming ticks in which midi_driver() would only count time: no event is due and no fade
+   is running. 0xFFFFFFFF if the driver is not playing at all. */
+uint32 AdlibDriver::midi_idle_ticks() {
+	if (!driver_installed || driver_status != kStatusPlaying) {
+		return 0xFFFFFFFF;
+	}
+	if (driver_fading_in || driver_fading_out || !midi_peek_event()) {
+		return 0;
+	}
+	return midi_event_delta;
+}
+
+/* does the work of up to midi_idle_ticks() calls to midi_driver() at once, so that the host can sleep
+   or render until the next event. Returns the number of ticks actually skipped. */
+uint32 AdlibDriver::midi_advance(uint32 ticks) {
+	uint32 idle = midi_idle_ticks();
+	if (idle == 0xFFFFFFFF) {
+		return 0;
+	}
+	if (ticks > idle) {
+		ticks = idle;
+	}
+
+	midi_position += ticks;
+	driver_timestamp += ticks;
+	midi_event_delta -= ticks;
+
+	if (ticks != 0) {
+		midi_publish_snapshot();
+	}
+	return ticks;
+}
+
+void AdlibDriver::midi_fadeout_and_stop() {
 	if (!driver_installed) {
 		return;
 	}
@@ -194,22 +297,23 @@ void midi_fadeout_and_stop() {
 	}
 }
 
-void midi_stop() {
+void AdlibDriver::midi_stop() {
+	midi_loaded_buffer = 0;	// the next song may come in the same buffer
 	ADLIB_mute_voices();
-	reset_hw_timer();	// restore the previous timer frequency
+	backend->reset_timer();	// restore the previous timer frequency
 	driver_status = kStatusStopped;
 }
 
-void midi_pause() {
+void AdlibDriver::midi_pause() {
 	if (!driver_installed) {
 		return;
 	}
 	ADLIB_mute_voices();
-	reset_hw_timer();
+	backend->reset_timer();
 	driver_status = kStatusPaused;
 }
 
-void midi_resume() {
+void AdlibDriver::midi_resume() {
 	if (!driver_installed) {
 		return;
 	}
@@ -217,18 +321,30 @@ void midi_resume() {
 		ADLIB_init_voices();
 		driver_fading_in = false;
 		driver_fading_out = false;
-
-		midi_buffer_pos = 4;	// skip signature
-		midi_tempo = read_midi_byte();
-		midi_division = read_midi_word();
-		if (midi_division > 255) {
-			midi_division = 192;
+		midi_loops = 0;
+
+		if (midi_source) {
+			// no checkpoints, the song is only ever read once
+			midi_checkpoints.clear();
+			midi_source->rewind();
+			midi_stream_start();
+			midi_event_delta = midi_peek_event() ? midi_peek_event()->tick : 0;
+			midi_position = 0;
+			midi_length = 0;
+			ADLIB_flush();
+		} else {
+			// every start from the top decodes the song again, unless midi_analyze_song() just did
+			if (!midi_song_loaded()) {
+				midi_load();
+				midi_analyze();
+			}
+			midi_loaded_buffer = 0;
+			midi_tempo = midi_analysis.tempo_map[0].tempo;
+			midi_quarter_us = midi_analysis.tempo_map[0].quarter_us;
+			midi_preload();	// the first notes find their instruments in place
+			midi_start_checkpoints();
 		}
 		
-		midi_event_delta = read_midi_word();
-		midi_event_type = read_midi_byte();
-		last_midi_event_type = 0;
-		
 		if (midi_fade_in_flag && !driver_fading_in) {
 			// start a fade in
 			full_volume = midi_volume;
@@ -242,97 +358,548 @@ void midi_resume() {
 	driver_status = kStatusPlaying;
 }
 
-void midi_set_tempo() {
+void AdlibDriver::midi_set_tempo() {
+	// the exact tempo of the last tempo event stands unless midi_tempo was changed since
+	if (midi_quarter_us == 0 || (uint8)(60000000 / midi_quarter_us) != midi_tempo) {
+		midi_quarter_us = midi_tempo ? 60000000 / midi_tempo : 0;
+	}
+
 	uint16 word_13A3F = (midi_tempo * midi_division) / 60;
-	set_hw_timer(word_13A3F);
+	backend->set_timer(word_13A3F);
+	backend->set_tick_period(midi_quarter_us, midi_division);
 }
 
-void process_midi_meta_event() {
-	uint8 type = read_midi_byte();
-	uint8 length = read_midi_byte();
+void AdlibDriver::midi_set_fade_rate(uint8 rate) {
+	midi_fade_volume_change_rate = rate;
+	fadeout_volume_cur = 0;
+	fadein_volume_cur = 0;
+}
 
-	if (type == 81) {	// tempo event
-		process_meta_tempo_event();
-	} else {
-		// discard other meta events
-		for (int i = 0; i < length; ++i) {
-			read_midi_byte();
+
+/**********************************
+	seeking
+*/
+
+// stands in for the real backend while the driver runs ahead silently
+class AdlibNullBackend : public AdlibBackend {
+public:
+	void write(const OplWrite *writes, uint16 count) {}
+	void set_timer(uint16 clock) {}
+	void reset_timer() {}
+};
+
+static AdlibNullBackend null_backend;
+
+void AdlibDriver::midi_save_checkpoint(DriverCheckpoint *checkpoint) {
+	checkpoint->position = midi_position;
+	checkpoint->event_index = midi_event_index;
+	checkpoint->event_delta = midi_event_delta;
+	checkpoint->tempo = midi_tempo;
+	checkpoint->quarter_us = midi_quarter_us;
+	memcpy(checkpoint->channels, midi_channels, sizeof(midi_channels));
+	memcpy(checkpoint->melodic, melodic, sizeof(melodic));
+	memcpy(checkpoint->notes_per_percussion, notes_per_percussion, sizeof(notes_per_percussion));
+	checkpoint->percussion_mask = driver_percussion_mask;
+	checkpoint->timestamp = driver_timestamp;
+	checkpoint->assigned_voice = driver_assigned_voice;
+	memcpy(checkpoint->registers, ADLIB_registers, sizeof(ADLIB_registers));
+	memcpy(checkpoint->registers_valid, ADLIB_registers_valid, sizeof(ADLIB_registers_valid));
+}
+
+void AdlibDriver::midi_restore_checkpoint(const DriverCheckpoint *checkpoint) {
+	midi_position = checkpoint->position;
+	midi_event_index = checkpoint->event_index;
+	midi_event_delta = checkpoint->event_delta;
+	midi_tempo = checkpoint->tempo;
+	midi_quarter_us = checkpoint->quarter_us;
+	memcpy(midi_channels, checkpoint->channels, sizeof(midi_channels));
+	memcpy(melodic, checkpoint->melodic, sizeof(melodic));
+	memcpy(notes_per_percussion, checkpoint->notes_per_percussion, sizeof(notes_per_percussion));
+	driver_percussion_mask = checkpoint->percussion_mask;
+	driver_timestamp = checkpoint->timestamp;
+	driver_assigned_voice = checkpoint->assigned_voice;
+	ADLIB_reset_voice_allocator();
+	memcpy(ADLIB_registers, checkpoint->registers, sizeof(ADLIB_registers));
+	memcpy(ADLIB_registers_valid, checkpoint->registers_valid, sizeof(ADLIB_registers_valid));
+}
+
+/* Only the order in which the voices were last used counts for the allocator, so the timestamps of
+   the state are the places of the voices in that order, and the same state found a loop later
+   compares equal. */
+void AdlibDriver::midi_save_state(DriverCheckpoint *state) {
+	midi_save_checkpoint(state);
+	int32 place = 0;
+	for (uint8 voice = voice_lru_head; voice != 0xFF; voice = voice_lru_next[voice]) {
+		state->melodic[voice].timestamp = place++;
+	}
+	state->timestamp = 0;
+}
+
+/* The position in ticks does not count: a song that loops comes back to the same events at a
+   different one. A fade running changes every note that follows. */
+bool AdlibDriver::midi_in_state(const DriverCheckpoint *state) {
+	if (driver_status != kStatusPlaying || driver_fading_in || driver_fading_out) {
+		return false;
+	}
+	DriverCheckpoint now;
+	midi_save_state(&now);
+
+	if (now.event_index != state->event_index || now.event_delta != state->event_delta ||
+		now.tempo != state->tempo || now.quarter_us != state->quarter_us ||
+		now.percussion_mask != state->percussion_mask || now.assigned_voice != state->assigned_voice ||
+		memcmp(now.channels, state->channels, sizeof(now.channels)) != 0 ||
+		memcmp(now.notes_per_percussion, state->notes_per_percussion, sizeof(now.notes_per_percussion)) != 0 ||
+		memcmp(now.registers, state->registers, sizeof(now.registers)) != 0 ||
+		memcmp(now.registers_valid, state->registers_valid, sizeof(now.registers_valid)) != 0) {
+		return false;
+	}
+	for (int i = 0; i < MAX_MELODIC_VOICES; ++i) {
+		const MelodicVoice *a = &now.melodic[i];
+		const MelodicVoice *b = &state->melodic[i];
+		if (a->key != b->key || a->program != b->program || a->channel != b->channel || a->timestamp != b->timestamp ||
+			a->fnumber != b->fnumber || a->octave != b->octave || a->in_use != b->in_use) {
+			return false;
 		}
 	}
+	return true;
 }
 
-#define BYTE3(a,b,c) (((a) << 16) | ((b) << 8) | (c))
+/* runs the driver without sound, with fades and looping off, until position is reached or the song
+   ends. The register shadow keeps track of what the chip would hold. */
+void AdlibDriver::midi_fast_forward(uint32 position) {
+	AdlibBackend *saved_backend = backend;
+	DriverStatus saved_status = driver_status;
+	bool saved_loop = midi_loop;
+	bool saved_fading_in = driver_fading_in;
+	bool saved_fading_out = driver_fading_out;
+	DriverStats saved_stats = stats;	// nothing is played for real
+
+	backend = &null_backend;
+	midi_fast_forwarding = true;
+	driver_status = kStatusPlaying;
+	midi_loop = false;
+	driver_fading_in = false;
+	driver_fading_out = false;
+	ADLIB_TRACE_SUSPEND();	// only what is heard is traced
 
-void process_meta_tempo_event() {
-	uint8 v0 = read_midi_byte();
-	uint8 v1 = read_midi_byte();
-	uint8 v2 = read_midi_byte();
-	
-	midi_tempo = 60000000 / BYTE3(v0,v1,v2);
-	midi_set_tempo();	
+	while (driver_status == kStatusPlaying && midi_position < position) {
+		if (midi_position % CHECKPOINT_INTERVAL == 0 && midi_position / CHECKPOINT_INTERVAL == midi_checkpoints.size()) {
+			midi_checkpoints.resize(midi_checkpoints.size() + 1);
+			midi_save_checkpoint(&midi_checkpoints.back());
+		}
+		midi_driver();
+	}
+
+	backend = saved_backend;
+	driver_status = saved_status;
+	midi_loop = saved_loop;
+	driver_fading_in = saved_fading_in;
+	driver_fading_out = saved_fading_out;
+	stats = saved_stats;
+	midi_fast_forwarding = false;
+	ADLIB_TRACE_RESUME();
+}
+
+/* rewinds to the top and saves the first checkpoint. The others are saved by the seeks that run past
+   them, so starting a song never plays it through. */
+void AdlibDriver::midi_start_checkpoints() {
+	// the chip must be up to date before the shadow is saved
+	ADLIB_flush();
+
+	midi_position = 0;
+	midi_event_index = 0;
+	midi_event_delta = midi_events.empty() ? 0 : midi_events[0].tick;
+	midi_length = midi_analysis.length_ticks;
+
+	midi_checkpoints.resize(1);
+	midi_save_checkpoint(&midi_checkpoints[0]);
+}
+
+/* Restores the last checkpoint before position and runs silently from there, then brings the chip in
+   line with the driver. Notes held at position restart from their attack. A position past the last
+   checkpoint saved runs from that one, saving the ones in between. Returns false if there is no song,
+   position is past its end or the song is streamed. */
+bool AdlibDriver::midi_seek(uint32 position) {
+	if (!driver_installed || driver_status == kStatusStopped || midi_source || position >= midi_length) {
+		return false;
+	}
+
+	ADLIB_flush();
+	uint32 index = position / CHECKPOINT_INTERVAL;
+	if (index >= midi_checkpoints.size()) {
+		index = midi_checkpoints.size() - 1;
+	}
+	midi_restore_checkpoint(&midi_checkpoints[index]);
+	midi_fast_forward(position);
+
+	if (driver_status == kStatusPaused) {
+		// keep quiet until midi_resume()
+		AdlibBackend *saved_backend = backend;
+		backend = &null_backend;
+		ADLIB_mute_voices();
+		ADLIB_flush();
+		backend = saved_backend;
+	}
+
+	ADLIB_refresh();
+
+	if (driver_status == kStatusPlaying) {
+		midi_set_tempo();
+	}
+	midi_publish_snapshot();
+	return true;
+}
+
+uint8 AdlibDriver::read_midi_byte() {
+	if (midi_source) {
+		if (midi_stream_tail == midi_stream_head && !midi_stream_refill()) {
+			midi_stream_overrun = true;
+			return 0;
+		}
+		return midi_stream_buffer[midi_stream_tail++ & (MIDI_STREAM_SIZE - 1)];
+	}
+	if (midi_buffer_pos >= midi_buffer_size) {
+		// truncated event at the end of the buffer
+		midi_buffer_pos++;
+		return 0;
+	}
+	return midi_buffer[midi_buffer_pos++];
 }
 
+uint16 AdlibDriver::read_midi_word() {
+	uint8 lo = read_midi_byte();
+	uint8 hi = read_midi_byte();
+	return lo | (hi << 8);
+}
+
+uint32 AdlibDriver::read_midi_VLQ() {
+	uint32 value = 0;
+	uint8 b;
+	do {
+		b = read_midi_byte();
+		value = (value << 7) | (b & 0x7F);
+	} while (b & 0x80);
+	return value;
+}
+
+#define BYTE3(a,b,c) (((a) << 16) | ((b) << 8) | (c))
+
 #define NOTE_KEY(note)			((note) & 0xFF)
 #define NOTE_VEL(note)			(((note) >> 8) & 0xFF)
-#define NOTEON_VEL(note)		((driver_lin_volume[midi_volume] * NOTE_VEL(note)) >> 8)
+#define NOTEON_VEL(vel)			((driver_lin_volume[midi_volume] * (vel)) >> 8)
 
-void process_midi_channel_event() {
-	midi_event_channel = midi_event_type & 0xF;
-	uint8 event_type = midi_event_type >> 4;
-	
-	uint16 note_info;
-	uint8 controller_number, controller_value;
+/* bytes left to read in the song, refilling the stream if needed */
+bool AdlibDriver::midi_input_left() {
+	if (midi_source) {
+		return midi_stream_tail != midi_stream_head || midi_stream_refill();
+	}
+	return midi_buffer_pos < midi_buffer_size;
+}
+
+/* true once a read went past the end of the song */
+bool AdlibDriver::midi_input_overrun() {
+	return midi_source ? midi_stream_overrun : midi_buffer_pos > midi_buffer_size;
+}
+
+void AdlibDriver::midi_skip_input(uint32 count) {
+	if (midi_source) {
+		while (count-- > 0 && !midi_stream_overrun) {
+			read_midi_byte();
+		}
+	} else {
+		midi_buffer_pos += count;
+	}
+}
+
+/* gives back the byte just read */
+void AdlibDriver::midi_unread_byte() {
+	if (midi_source) {
+		midi_stream_tail--;
+	} else {
+		midi_buffer_pos--;
+	}
+}
+
+void AdlibDriver::midi_read_header() {
+	uint8 signature[4];
+	for (int i = 0; i < 4; ++i) {
+		signature[i] = read_midi_byte();
+	}
+	midi_smf = memcmp(signature, "MThd", 4) == 0;
+	if (midi_smf) {
+		midi_read_smf_header();
+		return;
+	}
+
+	midi_tempo = read_midi_byte();
+	midi_quarter_us = midi_tempo ? 60000000 / midi_tempo : 0;
+	midi_division = read_midi_word();
+	if (midi_division > 255) {
+		midi_division = 192;
+	}
+
+	midi_decode_tick = 0;
+	midi_decode_status = 0;
+}
+
+/* Decodes the song until the next event that matters to the driver. Running status and tempo values
+   are resolved here, and events that have no effect on the driver (other meta events, aftertouch,
+   unknown controllers) are dropped. Returns false at the end of the song. */
+bool AdlibDriver::midi_decode_event(MidiEvent *event) {
+	if (midi_smf) {
+		return midi_decode_smf_event(event);
+	}
+
+	while (true) {
+		midi_decode_tick += read_midi_word();
+		uint8 midi_event_type = read_midi_byte();
+		if (!midi_input_left()) {
+			return false;	// end-of-file
+		}
+
+		event->tick = midi_decode_tick;
+		event->status = midi_event_type;
+		event->data1 = 0;
+		event->data2 = 0;
+		bool keep = true;
+
+		if (midi_event_type == 255) {
+			uint8 type = read_midi_byte();
+			uint8 length = read_midi_byte();
+
+			if (type == 81) {	// tempo event
+				uint8 v0 = read_midi_byte();
+				uint8 v1 = read_midi_byte();
+				uint8 v2 = read_midi_byte();
+				keep = BYTE3(v0,v1,v2) != 0;
+				event->data1 = v0;
+				event->data2 = (v1 << 8) | v2;
+			} else {
+				// discard other meta events
+				midi_skip_input(length);
+				keep = false;
+			}
+		} else {
+			if ((midi_event_type & 0x80) == 0) {
+				// repeat the last event
+				midi_unread_byte();
+				midi_event_type = midi_decode_status;
+				event->status = midi_event_type;
+			}
+
+			uint16 note_info;
+
+			switch (midi_event_type >> 4) {
+			case 9: // note on
+			case 8: // note off
+				note_info = read_midi_word();
+				event->data1 = NOTE_KEY(note_info);
+				event->data2 = NOTE_VEL(note_info);
+				break;
+
+			case 12:	// program change
+				event->data1 = read_midi_byte();
+				break;
+
+			case 13:	// channel aftertouch
+				read_midi_byte();
+				keep = false;
+				break;
+
+			case 10:	// note aftertouch
+				read_midi_word();
+				keep = false;
+				break;
+
+			case 14:	// pitch bend
+				// this should always read 2 bytes from the stream, so using VLQ might not be correct
+				event->data2 = read_midi_VLQ();
+				break;
+
+			case 11:	// controller
+				event->data1 = read_midi_byte();
+				event->data2 = read_midi_byte();
+				keep = event->data1 == 1 || event->data1 == 4 || event->data1 == 7 || event->data1 == 10 || event->data1 == 123;
+				break;
+
+			default:
+				keep = false;
+				break;
+			}
+
+			// checked once here, so the driver never has to: 7 bit data (14 bit bends) and channels 0-14
+			event->data1 &= 0x7F;
+			event->data2 &= (midi_event_type >> 4) == 14 ? 0x3FFF : 0x7F;
+			if ((midi_event_type & 0xF) >= NUM_MIDI_CHANNELS) {
+				keep = false;
+			}
+
+			midi_decode_status = midi_event_type;
+		}
+
+		if (midi_input_overrun()) {
+			return false;	// truncated event
+		}
+		if (keep) {
+			return true;
+		}
+	}
+}
+
+/* Decodes the whole song buffer into midi_events, once, when playback starts from the top, so the
+   playback loop only walks an array. */
+void AdlibDriver::midi_load() {
+	midi_events.clear();
+	midi_event_index = 0;
+
+	midi_buffer_pos = 0;
+	midi_read_header();
+
+	MidiEvent event;
+	while (midi_decode_event(&event)) {
+		midi_events.push_back(event);
+	}
+}
+
+/* whether midi_analyze_song() decoded the song in midi_buffer since the last midi_resume() or
+   midi_stop(). Anything else gets the song decoded again, as the client may have written another one
+   over the same buffer. */
+bool AdlibDriver::midi_song_loaded() {
+	return midi_loaded_buffer != 0 && midi_loaded_buffer == midi_buffer && midi_loaded_size == midi_buffer_size;
+}
+
+/* the event due next, 0 at the end of the song */
+const MidiEvent *AdlibDriver::midi_peek_event() {
+	if (midi_source) {
+		return midi_stream_event_valid ? &midi_stream_event : 0;
+	}
+	return midi_event_index < midi_events.size() ? &midi_events[midi_event_index] : 0;
+}
+
+void AdlibDriver::midi_pop_event() {
+	if (midi_source) {
+		midi_stream_event_valid = midi_decode_event(&midi_stream_event);
+	} else {
+		midi_event_index++;
+	}
+}
+
+/* back to the first event, for looping. Returns false if there is none to go back to. */
+bool AdlibDriver::midi_rewind() {
+	if (midi_source) {
+		uint8 tempo = midi_tempo;
+		uint32 quarter_us = midi_quarter_us;
+		bool rewound = midi_source->rewind();
+		if (rewound) {
+			midi_stream_start();
+		}
+		midi_tempo = tempo;	// looping keeps the current tempo
+		midi_quarter_us = quarter_us;
+		return rewound && midi_stream_event_valid;
+	}
+	midi_event_index = 0;
+	return !midi_events.empty();
+}
+
+
+/**********************************
+	streaming
+*/
+
+void AdlibDriver::midi_set_source(AdlibSongSource *source) {
+	midi_source = source;
+	midi_loaded_buffer = 0;	// streaming reuses the decoder state
+}
+
+/* Tops up the ring with whatever the source can give. Returns false if nothing came, at the end of
+   the song. */
+bool AdlibDriver::midi_stream_refill() {
+	uint32 count = 0;
+	while (midi_stream_head - midi_stream_tail < MIDI_STREAM_SIZE) {
+		uint32 start = midi_stream_head & (MIDI_STREAM_SIZE - 1);
+		uint32 free = MIDI_STREAM_SIZE - (midi_stream_head - midi_stream_tail);
+		if (free > MIDI_STREAM_SIZE - start) {
+			free = MIDI_STREAM_SIZE - start;	// up to the end of the ring, the rest on the next round
+		}
+		uint32 got = midi_source->refill(&midi_stream_buffer[start], free);
+		if (got == 0) {
+			break;
+		}
+		midi_stream_head += got;
+		count += got;
+		if (got < free) {
+			break;
+		}
+	}
+	return count != 0;
+}
+
+/* reads the header and decodes the first event, from the start of the source */
+void AdlibDriver::midi_stream_start() {
+	midi_stream_head = 0;
+	midi_stream_tail = 0;
+	midi_stream_overrun = false;
+	midi_read_header();
+	midi_stream_event_valid = midi_decode_event(&midi_stream_event);
+}
+
+
+
+void AdlibDriver::process_midi_event(const MidiEvent *event) {
+	if (event->status == 255) {
+		// tempo event
+		midi_quarter_us = (event->data1 << 16) | event->data2;
+		midi_tempo = (uint8)(60000000 / midi_quarter_us);
+		ADLIB_TRACE_POINT(kTraceTempo, midi_tempo, midi_quarter_us);
+		midi_set_tempo();
+		return;
+	}
+
+	ADLIB_TRACE_POINT(kTraceEvent, event->status, event->data1 | event->data2 << 8);
+
+	midi_event_channel = event->status & 0xF;
+	uint8 event_type = event->status >> 4;
 	
 	switch (event_type) {
 	case 9: // note on
-		note_info = read_midi_word();
-		midi_onoff_note = NOTE_KEY(note_info);
-		midi_onoff_velocity = NOTEON_VEL(midi_onoff_note);
+		midi_onoff_note = event->data1 & 0x7F;	// events may come from outside the decoder
+		midi_onoff_velocity = NOTEON_VEL(event->data2);
 		ADLIB_turn_on_voice();
 		break;	// return
 		
 	case 8: // note off
-		note_info = read_midi_word();
-		midi_onoff_note = NOTE_KEY(note_info);
-		midi_onoff_velocity = NOTE_VEL(midi_onoff_note);
+		midi_onoff_note = event->data1 & 0x7F;
+		midi_onoff_velocity = event->data2;
 		ADLIB_turn_off_voice();
 		break;	// return
 	
 	case 12:	// program change
-		midi_channels[midi_event_channel].program = read_midi_byte();
+		midi_channels[midi_event_channel].program = event->data1;
 		break;	// return
-		
-	case 13:	// channel aftertouch
-		read_midi_byte();	
-		break;	// return		
-	
-	case 10:	// note aftertouch
-		read_midi_word();	
-		break;	// return		
 
 	case 14:	// pitch bend
-		// this should always read 2 bytes from the stream, so using VLQ might not be correct
-		midi_pitch_bend = read_midi_VLQ();	
+		midi_pitch_bend = event->data2;
 		ADLIB_pitch_bend(midi_pitch_bend, midi_event_channel);
 		break;	
 	
 	case 11:	// controller
-		controller_number = read_midi_byte();
-		controller_value = read_midi_byte();
-		
-		switch (controller_number) {
+		switch (event->data1) {
 		case 1:	// modulation
-			ADLIB_modulation(controller_value);
+			ADLIB_modulation(event->data2);
 			break;	// return		
 			
 		case 7: // main volume
-			midi_channels[midi_event_channel].volume = controller_value;
+			midi_channels[midi_event_channel].volume = event->data2;
 			break;	// return		
 		
 		case 4: // foot controller
-			midi_channels[midi_event_channel].pedal = (controller_value >= 64);
+			midi_channels[midi_event_channel].pedal = (event->data2 >= 64);
 			break;	// return					
 			
+		case 10: // pan, only heard on OPL3
+			midi_channels[midi_event_channel].pan = event->data2;
+			break;	// return
+			
 		case 123: // all notes off
 			ADLIB_mute_voices();
 			break; // return
@@ -345,22 +912,21 @@ void process_midi_channel_event() {
 	}
 }
 
-void midi_init() {
-	
-	// linear map [0..127] to [0..128] (user volume to driver volume?)
-	const float k = 128.0f / 127.0f;
-	for (int i = 0; i < 128; ++i) {
-		driver_lin_volume[i] = (uint32)round(k * (float)i);
-	}
-
+void AdlibDriver::midi_init() {
+	midi_reset_stats();
 	ADLIB_init();
 	
-	midi_buffer_pos = 4;
+	midi_events.clear();
+	midi_loaded_buffer = 0;
+	midi_checkpoints.clear();
+	midi_event_index = 0;
+	midi_position = 0;
+	midi_length = 0;
+	midi_loops = 0;
 	midi_tempo = 120;
+	midi_quarter_us = 500000;
 	midi_division = 192;
 	midi_event_delta = 0;
-	midi_event_type = 0;
-	last_midi_event_type = 0;
 	midi_fade_volume_change_rate = 0;
 	midi_fade_out_flag = false;
 	midi_fade_in_flag = false;
@@ -369,6 +935,308 @@ void midi_init() {
 	midi_loop = false;
 	driver_status = kStatusStopped;
 	midi_volume = 127;
+	
+	ADLIB_flush();
+}
+
+
+/**********************************
+	standard MIDI files
+*/
+
+/* After "MThd": the length of the header, the format, the number of tracks and the division, big
+   endian, then the tracks as "MTrk" chunks. Format 2 (independent sequences) and SMPTE divisions are
+   not played. The tracks of a streamed type 1 song are spread over the file: they are found from the
+   chunk lengths and each is read at its own place, so the source has to implement read(). */
+void AdlibDriver::midi_read_smf_header() {
+	uint32 length = 0;
+	for (int i = 0; i < 4; ++i) {
+		length = (length << 8) | read_midi_byte();
+	}
+	uint16 format = (read_midi_byte() << 8) | read_midi_byte();
+	uint16 tracks = (read_midi_byte() << 8) | read_midi_byte();
+	uint16 division = (read_midi_byte() << 8) | read_midi_byte();
+	if (length > 6) {
+		midi_skip_input(length - 6);
+	}
+
+	midi_tempo = 120;
+	midi_quarter_us = 500000;
+	midi_division = division;
+	midi_tracks.clear();
+	midi_track_heap.clear();
+	midi_track_cursors = false;
+
+	if (format > 1 || division == 0 || division > SMF_MAX_DIVISION) {
+		midi_division = 192;
+		return;
+	}
+	if (format == 0) {
+		tracks = 1;
+	}
+	midi_track_cursors = midi_source && tracks > 1;
+
+	uint32 offset = 8 + (length > 6 ? length : 6);	// of the first chunk
+	uint8 chunk[8];
+	while (midi_track_cursors && midi_tracks.size() < tracks && midi_source->read(offset, chunk, 8) == 8) {
+		length = (chunk[4] << 24) | (chunk[5] << 16) | (chunk[6] << 8) | chunk[7];
+		offset += 8;
+		if (length > 0xFFFFFFFF - offset) {
+			break;
+		}
+		if (memcmp(chunk, "MTrk", 4) == 0) {
+			MidiTrack track;
+			track.pos = offset;
+			track.end = offset + length;	// cut short on the first read that comes back empty
+			track.tick = 0;
+			track.status = 0;
+			track.buffer_pos = offset;
+			track.buffer_len = 0;
+			midi_tracks.push_back(track);
+		}
+		offset += length;
+	}
+	midi_track_buffers.resize(midi_track_cursors ? midi_tracks.size() * SMF_TRACK_BUFFER : 0);
+
+	while (!midi_track_cursors && midi_tracks.size() < tracks && midi_input_left()) {
+		uint8 id[4];
+		for (int i = 0; i < 4; ++i) {
+			id[i] = read_midi_byte();
+		}
+		length = 0;
+		for (int i = 0; i < 4; ++i) {
+			length = (length << 8) | read_midi_byte();
+		}
+		if (midi_input_overrun()) {
+			break;
+		}
+
+		uint32 start = midi_source ? midi_stream_tail : midi_buffer_pos;
+		if (!midi_source && length > midi_buffer_size - start) {
+			length = midi_buffer_size - start;	// truncated file
+		}
+		if (memcmp(id, "MTrk", 4) != 0) {
+			midi_skip_input(length);	// unknown chunk
+			continue;
+		}
+
+		MidiTrack track;
+		track.pos = start;
+		track.end = start + length;
+		track.tick = 0;
+		track.status = 0;
+		midi_tracks.push_back(track);
+		if (!midi_source) {
+			midi_skip_input(length);	// a streamed track is read as it plays
+		}
+	}
+
+	for (uint32 i = 0; i < midi_tracks.size(); ++i) {
+		MidiTrack *track = &midi_tracks[i];
+		track->tick = midi_track_VLQ(track);
+		if (track->pos < track->end) {
+			midi_track_heap.push_back(i);
+		}
+	}
+	for (uint32 i = midi_track_heap.size() / 2; i-- > 0; ) {
+		midi_track_sift_down(i);
+	}
+}
+
+uint8 AdlibDriver::midi_track_byte(MidiTrack *track) {
+	if (track->pos >= track->end) {
+		track->pos = track->end + 1;	// truncated event
+		return 0;
+	}
+	track->pos++;
+	if (!midi_source) {
+		return midi_buffer[track->pos - 1];
+	}
+	if (!midi_track_cursors) {
+		return read_midi_byte();
+	}
+
+	uint32 offset = track->pos - 1;
+	uint8 *buffer = &midi_track_buffers[(track - &midi_tracks[0]) * SMF_TRACK_BUFFER];
+	if (offset - track->buffer_pos >= track->buffer_len) {
+		uint32 size = track->end - offset < SMF_TRACK_BUFFER ? track->end - offset : SMF_TRACK_BUFFER;
+		track->buffer_pos = offset;
+		track->buffer_len = midi_source->read(offset, buffer, size);
+		if (track->buffer_len == 0) {
+			track->end = offset;	// the file is shorter than the track says
+			track->pos = offset + 1;
+			return 0;
+		}
+	}
+	return buffer[offset - track->buffer_pos];
+}
+
+uint32 AdlibDriver::midi_track_VLQ(MidiTrack *track) {
+	uint32 value = 0;
+	uint8 b;
+	int n = 0;
+	do {
+		b = midi_track_byte(track);
+		value = (value << 7) | (b & 0x7F);
+	} while ((b & 0x80) && ++n < 4);
+	return value;
+}
+
+void AdlibDriver::midi_track_skip(MidiTrack *track, uint32 count) {
+	uint32 left = track->pos < track->end ? track->end - track->pos : 0;
+	if (count > left) {
+		count = left;
+		track->pos = track->end + 1;
+	} else {
+		track->pos += count;
+	}
+	if (midi_source && !midi_track_cursors) {
+		midi_skip_input(count);
+	}
+}
+
+/* Decodes the next event of a track into event, as midi_decode_event() does for the driver's own
+   format. Returns false if the driver has no use for it. */
+bool AdlibDriver::midi_decode_track_event(MidiTrack *track, MidiEvent *event) {
+	event->tick = track->tick;
+	event->data1 = 0;
+	event->data2 = 0;
+
+	uint8 status = midi_track_byte(track);
+	uint8 data = 0;
+	if (status < 0x80) {
+		// running status: this was the first data byte
+		data = status;
+		status = track->status;
+		if (status == 0) {
+			track->end = track->pos;	// garbage, give up on the track
+			return false;
+		}
+	} else if (status < 0xF0) {
+		track->status = status;
+		data = midi_track_byte(track);
+	}
+	event->status = status;
+
+	if (status == 0xFF) {
+		uint8 type = midi_track_byte(track);
+		uint32 length = midi_track_VLQ(track);
+
+		if (type == 0x2F) {	// end of track
+			track->end = track->pos;
+			return false;
+		}
+		if (type == 81 && length >= 3) {	// tempo event
+			uint8 v0 = midi_track_byte(track);
+			uint8 v1 = midi_track_byte(track);
+			uint8 v2 = midi_track_byte(track);
+			midi_track_skip(track, length - 3);
+			event->data1 = v0;
+			event->data2 = (v1 << 8) | v2;
+			return BYTE3(v0,v1,v2) != 0;
+		}
+		midi_track_skip(track, length);
+		return false;
+	}
+	if (status == 0xF0 || status == 0xF7) {
+		// system exclusive
+		midi_track_skip(track, midi_track_VLQ(track));
+		return false;
+	}
+	if (status > 0xF0) {
+		track->end = track->pos;	// not allowed in a file
+		return false;
+	}
+
+	bool keep = (status & 0xF) < NUM_MIDI_CHANNELS;
+	switch (status >> 4) {
+	case 9: // note on
+	case 8: // note off
+		event->data1 = data;
+		event->data2 = midi_track_byte(track);
+		break;
+
+	case 12:	// program change
+		event->data1 = data;
+		break;
+
+	case 13:	// channel aftertouch
+		keep = false;
+		break;
+
+	case 10:	// note aftertouch
+		midi_track_byte(track);
+		keep = false;
+		break;
+
+	case 14:	// pitch bend, least significant 7 bits first
+		event->data2 = data | (midi_track_byte(track) << 7);
+		break;
+
+	case 11:	// controller
+		event->data1 = data;
+		event->data2 = midi_track_byte(track);
+		keep = keep && (event->data1 == 1 || event->data1 == 4 || event->data1 == 7 || event->data1 == 10 || event->data1 == 123);
+		break;
+	}
+	event->data1 &= 0x7F;	// a broken file can put anything there
+	event->data2 &= status >> 4 == 14 ? 0x3FFF : 0x7F;
+	return keep;
+}
+
+/* takes the events from the track due first, then reads the delta of its next event and puts it
+   back in the heap. Events on the same tick keep the order of their tracks. */
+bool AdlibDriver::midi_decode_smf_event(MidiEvent *event) {
+	while (!midi_track_heap.empty()) {
+		MidiTrack *track = &midi_tracks[midi_track_heap[0]];
+		bool keep = midi_decode_track_event(track, event);
+		if (midi_input_overrun()) {
+			return false;	// end-of-file
+		}
+		if (track->pos > track->end) {
+			keep = false;	// truncated event
+		}
+
+		if (track->pos < track->end) {
+			track->tick += midi_track_VLQ(track);
+		}
+		if (track->pos >= track->end) {
+			// no events left in the track
+			midi_track_heap[0] = midi_track_heap.back();
+			midi_track_heap.pop_back();
+		}
+		midi_track_sift_down(0);
+
+		if (keep) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool AdlibDriver::midi_track_before(uint16 a, uint16 b) {
+	return midi_tracks[a].tick != midi_tracks[b].tick ? midi_tracks[a].tick < midi_tracks[b].tick : a < b;
+}
+
+void AdlibDriver::midi_track_sift_down(uint32 index) {
+	uint32 count = midi_track_heap.size();
+	while (true) {
+		uint32 first = index;
+		uint32 left = 2 * index + 1;
+		if (left < count && midi_track_before(midi_track_heap[left], midi_track_heap[first])) {
+			first = left;
+		}
+		if (left + 1 < count && midi_track_before(midi_track_heap[left + 1], midi_track_heap[first])) {
+			first = left + 1;
+		}
+		if (first == index) {
+			return;
+		}
+		uint16 track = midi_track_heap[index];
+		midi_track_heap[index] = midi_track_heap[first];
+		midi_track_heap[first] = track;
+		index = first;
+	}
 }
 
 
@@ -585,27 +1453,140 @@ PercussionNote percussion_notes[47] = {
 
 
 /**********************************
-	low-level OPL manipulation
+	song analysis
 */
 
-#define NUM_VOICES				9		// the driver only uses rhythm mode, so there are 9 FM voices available
+void AdlibDriver::midi_analyze_song() {
+	if (driver_status != kStatusStopped || midi_source) {
+		return;
+	}
+	midi_load();
+	midi_analyze();
+	midi_loaded_buffer = midi_buffer;
+	midi_loaded_size = midi_buffer_size;
+}
 
-#define NUM_MELODIC_VOICES		6		// adlib FM voices 0-5	(2 operators each)
-#define NUM_PERCUSSIONS			5		// adlib FM voice 6 	(2 operators), and voices 7-8 (1 operator each)
+/* goes through the decoded events once, keeping track of programs and held notes as the playback
+   would. The instruments the preload sets up are picked on the way. */
+void AdlibDriver::midi_analyze() {
+	SongAnalysis *analysis = &midi_analysis;
+	uint8 programs[NUM_MIDI_CHANNELS];
+	uint32 held[NUM_MIDI_CHANNELS][4];	// keys down on each channel
+	uint8 polyphony = 0;
+	uint32 preloaded[4];	// programs in midi_preload_list
+	uint8 preloaded_voices = 0;
+	uint8 preloaded_percussions = 0;	// one bit per percussion
+
+	memset(analysis->programs, 0, sizeof(analysis->programs));
+	analysis->peak_polyphony = 0;
+	analysis->percussion_notes = 0;
+	analysis->tempo_map.clear();
+	memset(programs, 0, sizeof(programs));
+	memset(held, 0, sizeof(held));
+	memset(preloaded, 0, sizeof(preloaded));
+	midi_preload_list.clear();
+
+	TempoChange change;
+	change.tick = 0;
+	change.tempo = midi_tempo;
+	change.quarter_us = midi_quarter_us;
+	analysis->tempo_map.push_back(change);
+
+	for (uint32 i = 0; i < midi_events.size(); ++i) {
+		const MidiEvent *event = &midi_events[i];
+		if (event->status == 255) {
+			change.tick = event->tick;
+			change.quarter_us = (event->data1 << 16) | event->data2;
+			change.tempo = (uint8)(60000000 / change.quarter_us);
+			analysis->tempo_map.push_back(change);
+			continue;
+		}
 
-struct MelodicVoice {
-	int8 key;			// the note being played
-	int8 program;		// the midi instrument? (see voice)
-	int8 channel;		// the midi channel
-	int32 timestamp;
-	uint16 fnumber;		// frequency id (see lookup table)
-	int8 octave;
-	bool in_use;
-} melodic[NUM_MELODIC_VOICES];
+		uint8 channel = event->status & 0xF;
+		uint8 key = event->data1 & 0x7F;
+		uint32 bit = 1 << (key & 31);
+		if (channel >= NUM_MIDI_CHANNELS) {
+			continue;	// never played
+		}
+		bool on = (event->status >> 4) == 9 && event->data2 != 0;
+		bool off = (event->status >> 4) == 8 || ((event->status >> 4) == 9 && event->data2 == 0);
+
+		if ((event->status >> 4) == 12) {
+			programs[channel] = event->data1 & 0x7F;
+		} else if (channel == 9) {
+			if (on && key >= 35 && key <= 81) {
+				analysis->percussion_notes |= 1ULL << (key - 35);
+				PercussionNote *note = &percussion_notes[key - 35];
+				if (note->valid && !(preloaded_percussions & (1 << note->percussion))) {
+					preloaded_percussions |= 1 << note->percussion;
+					midi_preload_list.push_back(0x8000 | key);
+				}
+			}
+		} else if (on) {
+			analysis->programs[channel][programs[channel] >> 5] |= 1 << (programs[channel] & 31);
+			if (preloaded_voices < melodic_voices && !(preloaded[programs[channel] >> 5] & (1 << (programs[channel] & 31)))) {
+				preloaded[programs[channel] >> 5] |= 1 << (programs[channel] & 31);
+				preloaded_voices++;
+				midi_preload_list.push_back((channel << 8) | programs[channel]);
+			}
+			if (!(held[channel][key >> 5] & bit)) {
+				held[channel][key >> 5] |= bit;
+				if (++polyphony > analysis->peak_polyphony) {
+					analysis->peak_polyphony = polyphony;
+				}
+			}
+		} else if (off && (held[channel][key >> 5] & bit)) {
+			held[channel][key >> 5] &= ~bit;
+			polyphony--;
+		} else if ((event->status >> 4) == 11 && event->data1 == 123) {
+			// all notes off
+			memset(held, 0, sizeof(held));
+			polyphony = 0;
+		}
+	}
 
-// notes being currently played for each percussion (0xFF if none)
-uint8 notes_per_percussion[NUM_PERCUSSIONS];
+	/* The driver processes the events of tick t on its call t + 1 and stops on the call after the
+	   last one. A tempo event changes the length of the calls that follow it, exactly on a virtual
+	   clock (the timer of the real chip rounds it to whole Hz). */
+	analysis->length_ticks = (midi_events.empty() ? 0 : midi_events.back().tick) + 1;
+	double ms = 0;
+	for (uint32 i = 0; i < analysis->tempo_map.size(); ++i) {
+		uint32 start = analysis->tempo_map[i].tick;
+		uint32 end = i + 1 < analysis->tempo_map.size() ? analysis->tempo_map[i + 1].tick : analysis->length_ticks;
+		ms += (double)(end - start) * analysis->tempo_map[i].quarter_us / (1000.0 * midi_division);
+	}
+	analysis->length_ms = (uint32)(ms + 0.5);
+}
+
+/* Programs the melodic voices with the instruments in the order the song first plays them, and each
+   percussion with its first drum, as listed by midi_analyze(). Only the chip is set up: the allocator
+   does not know about it and picks the same voices as without a preload, and the writes it then makes
+   to program a voice are elided by the register cache, so the first notes cost a few writes instead of
+   a whole instrument. The voices are taken in the order the allocator hands out free voices; a guess
+   it does not follow only costs the writes. */
+void AdlibDriver::midi_preload() {
+	uint8 voice = driver_assigned_voice;
 
+	for (uint32 i = 0; i < midi_preload_list.size(); ++i) {
+		uint16 entry = midi_preload_list[i];
+
+		if (entry & 0x8000) {
+			uint8 key = entry & 0x7F;
+			PercussionNote *note = &percussion_notes[key - 35];
+			ADLIB_setup_percussion(note);
+			notes_per_percussion[note->percussion] = key;
+		} else {
+			voice = voice + 1 == melodic_voices ? 0 : voice + 1;
+			midi_event_channel = entry >> 8;	// for the pan
+			ADLIB_load_melodic_program(voice, entry & 0xFF);
+		}
+	}
+}
+
+
+/**********************************
+	low-level OPL manipulation
+*/
 
 uint8 operator_offsets_for_percussion[] = {
 	0x11, // hi-hat operator 		[channel 7, operator 1]
@@ -624,7 +1605,12 @@ uint8 operator2_offset_for_melodic[NUM_VOICES] = {
 	 0x3,  0x4,  0x5,  0xb,  0xc,  0xd, 0x13, 0x14, 0x15
 };
 
-uint16 melodic_fnumbers[36] = {
+// hardware channel of each melodic voice. On OPL3, channels 9-17 are those of the second bank.
+const uint8 melodic_channels[MAX_MELODIC_VOICES] = {
+	 0,  1,  2,  3,  4,  5,  9, 10, 11, 12, 13, 14, 15, 16, 17
+};
+
+const uint16 melodic_fnumbers[36] = {
 	 0x55,   0x5a,   0x60,   0x66,   0x6c,   0x72,   0x79,   0x80,   0x88,   
 	 0x90,   0x99,   0xa1,   0xab,   0xb5,   0xc0,   0xcc,   0xd8,   0xe5,   
 	 0xf2,  0x101,  0x110,  0x120,  0x132,  0x143,  0x156,  0x16b,  0x181,  
@@ -644,25 +1630,27 @@ uint16 melodic_fnumbers[36] = {
 */
 #define ADLIB_DEFAULT_PERCUSSION_MASK	0x20
 
-uint8 driver_percussion_mask;
-
-int32 driver_timestamp;
-
-uint8 driver_assigned_voice;		// last voice assigned to a channel
-
 /*	
  *	bit  7-6: unused		
  *	bit   5 : key on (0 mutes voice)
  *	bits 4-2: octave
  *	bits 1-0: higher 2 bits of f-number
  */
-#define ADLIB_B0(key_on,octave,fnumber) ( ((key_on) & 0x10) | ((octave) & 7) | ((fnumber) & 3) )
+#define ADLIB_B0(key_on,octave,fnumber) ( ((key_on) & 0x20) | ((octave) & 0x1C) | ((fnumber) & 3) )
 
 #define ADLIB_A0(fnumber) 		(fnumber)
 
-#define ADLIB_40(scaling,total) ( ((scaling) & 0xC0) | ((total_level) & 0x3F) )
+// register and operator addresses of a hardware channel, in either OPL3 bank
+#define ADLIB_BANK(channel)				((channel) >= 9 ? 0x100 : 0)
+#define ADLIB_CHANNEL_REG(base,channel)	(ADLIB_BANK(channel) + (base) + (channel) % 9)
+#define ADLIB_OPERATOR1(channel)		(ADLIB_BANK(channel) + operator1_offset_for_melodic[(channel) % 9])
+#define ADLIB_OPERATOR2(channel)		(ADLIB_BANK(channel) + operator2_offset_for_melodic[(channel) % 9])
 
-#define INC_MOD(n,max)		((n+1) % max)
+#define OPL3_PAN_LEFT			0x10		// 0xC0 bits 4-5, OPL3 only
+#define OPL3_PAN_RIGHT			0x20
+#define OPL3_PAN_CENTER			0x30
+
+#define ADLIB_40(scaling,total) ( ((scaling) & 0xC0) | ((total_level) & 0x3F) )
 
 
 // the maximum volume value in the hardware and its bitmask
@@ -670,37 +1658,162 @@ uint8 driver_assigned_voice;		// last voice assigned to a channel
 #define LEVEL_MASK				0x3F		//	63
 
 #define PITCH_BEND_THRESH		8192
+#define MELODIC_KEY(voice)		((uint8)melodic[voice].key & 0x7F)	// key is int8, -1 when unused
 
-uint32 ADLIB_log_volume[129];
-
-uint8 calc_level(uint8 velocity, uint8 program_level, uint8 midi_channel) {
+uint8 AdlibDriver::calc_level(uint8 velocity, uint8 program_level, uint8 midi_channel) {
 /* combines note, program and channel levels, then scales it down to fit the six bits available in
    the hardware. The result is subtracted from MAXIMUM_LEVEL as the hardware's logic is
    reversed. See http://www.shipbrook.com/jeff/sb.html#40-55.
  */
-	uint32 note_level = ADLIB_log_volume[velocity];
-	uint32 channel_level = ADLIB_log_volume[midi_channels[midi_channel].volume];
+	if (channel_levels_volume[midi_channel] != midi_channels[midi_channel].volume) {
+		ADLIB_build_channel_levels(midi_channel);
+	}
 	// program_level comes from the static data and is probably already in the correct logarithmic scale
 
-	return MAXIMUM_LEVEL - ((note_level * channel_level * program_level) >> 16);
+	return MAXIMUM_LEVEL - ((channel_levels[midi_channel][velocity] * program_level) >> 16);
 }
 
+/* note level times channel level for every velocity, rebuilt only when the channel volume changes */
+void AdlibDriver::ADLIB_build_channel_levels(uint8 midi_channel) {
+	uint8 volume = midi_channels[midi_channel].volume;
+	uint32 channel_level = ADLIB_log_volume[volume > 128 ? 128 : volume];
+
+	for (int i = 0; i < 129; ++i) {
+		channel_levels[midi_channel][i] = ADLIB_log_volume[i] * channel_level;
+	}
+	channel_levels_volume[midi_channel] = volume;
+}
 
-void ADLIB_play_note(uint8 voice, uint8 octave, uint16 fnumber);
-void ADLIB_play_melodic_note(uint8 voice);
-void ADLIB_mute_melodic_voice(uint8 voice);
-void ADLIB_program_melodic_voice(uint8 voice, uint8 program);
-void ADLIB_turn_on_melodic();
-void ADLIB_play_percussion(PercussionNote *note, uint8 velocity);
-void ADLIB_setup_percussion(PercussionNote *note);
-void ADLIB_onoff_percussion(bool onoff);
-void ADLIB_out(uint8 command, uint8 value);
 
+/**********************************
+	register write queue
+*/
+
+/* Registers whose writes have side effects besides storing the value: 0x01 (test/waveform enable),
+   0x02-0x03 (timer preset, reloaded on every write) and 0x04 (timer control, 0x80 resets the IRQ).
+   Key on/off in 0xB0-0xB8 and 0xBD is edge triggered: an identical rewrite never retriggers a note,
+   and every retrigger in the driver clears the bit with a separate write first, so those registers
+   are safe to cache. */
+static bool ADLIB_register_volatile(uint16 command) {
+	return command <= 0x04;
+}
+
+/* true if going from old_value to value switches a note on or off. Both writes must reach the chip,
+   or the retrigger is lost. */
+static bool ADLIB_key_edge(uint16 command, uint8 old_value, uint8 value) {
+	if ((command & 0xFF) >= 0xB0 && (command & 0xFF) <= 0xB8) {
+		return ((old_value ^ value) & 0x20) != 0;
+	}
+	if (command == 0xBD) {
+		return ((old_value ^ value) & 0x1F) != 0;
+	}
+	return false;
+}
+
+void AdlibDriver::ADLIB_reset_register_cache() {
+	memset(ADLIB_registers_valid, 0, sizeof(ADLIB_registers_valid));
+	memset(ADLIB_write_queue_slot, 0xFF, sizeof(ADLIB_write_queue_slot));
+	ADLIB_write_queue_len = 0;
+}
+
+/* Register writes are queued during a driver tick and sent to the chip in one batch at the end of
+   it. A register written more than once in the same tick only keeps its last value, as all the
+   writes of a tick happen at the same instant anyway. */
+void AdlibDriver::ADLIB_out(uint16 command, uint8 value) {
+	ADLIB_TRACE_POINT(kTraceWrite, command, value);
+
+	int16 slot = ADLIB_write_queue_slot[command];
+	
+	if (slot >= 0 && !ADLIB_register_volatile(command) && !ADLIB_key_edge(command, ADLIB_write_queue[slot].value, value)) {
+		// overwrite the pending value
+		ADLIB_write_queue[slot].value = value;
+		stats.writes_elided++;
+		return;
+	}
+	
+	if (ADLIB_write_queue_len == WRITE_QUEUE_SIZE) {
+		ADLIB_flush();
+	}
+	
+	slot = ADLIB_write_queue_len++;
+	ADLIB_write_queue[slot].tick = driver_timestamp;
+	ADLIB_write_queue[slot].command = command;
+	ADLIB_write_queue[slot].value = value;
+	ADLIB_write_queue_slot[command] = slot;
+}
+
+void AdlibDriver::ADLIB_flush() {
+	uint16 count = 0;
+	
+	for (int i = 0; i < ADLIB_write_queue_len; ++i) {
+		OplWrite *write = &ADLIB_write_queue[i];
+		uint16 command = write->command;
+		uint32 bit = 1 << (command & 31);
+		
+		ADLIB_write_queue_slot[command] = -1;
+		
+		if ((ADLIB_registers_valid[command >> 5] & bit) && ADLIB_registers[command] == write->value && !ADLIB_register_volatile(command)) {
+			// the chip already holds this value
+			stats.writes_elided++;
+			continue;
+		}
+		
+		ADLIB_registers_valid[command >> 5] |= bit;
+		ADLIB_registers[command] = write->value;
+		stats.writes_issued++;
+		ADLIB_write_queue[count++] = *write;
+	}
+	
+	ADLIB_write_queue_len = 0;
+	if (count != 0) {
+		backend->write(ADLIB_write_queue, count);
+	}
+}
+
+/* value with the key on bits cleared */
+static uint8 ADLIB_key_off(uint16 command, uint8 value) {
+	if ((command & 0xFF) >= 0xB0 && (command & 0xFF) <= 0xB8) {
+		return value & ~0x20;
+	}
+	if (command == 0xBD) {
+		return value & ~0x1F;
+	}
+	return value;
+}
+
+/* Sends the whole register shadow to the chip, after a seek left it out of date. Keys are written off
+   first and switched on again at the end, so the notes held in the shadow sound from their attack. */
+void AdlibDriver::ADLIB_refresh() {
+	uint16 count = 0;
+
+	for (int pass = 0; pass < 2; ++pass) {
+		for (int command = 0x01; command < NUM_REGISTERS; ++command) {
+			if (!(ADLIB_registers_valid[command >> 5] & (1 << (command & 31)))) {
+				continue;
+			}
+			if (command >= 0x02 && command <= 0x04) {
+				continue;	// timers
+			}
+
+			uint8 value = ADLIB_registers[command];
+			uint8 off = ADLIB_key_off(command, value);
+			if (pass == 0 || off != value) {
+				OplWrite *write = &ADLIB_write_queue[count++];
+				write->tick = driver_timestamp;
+				write->command = command;
+				write->value = pass == 0 ? off : value;
+			}
+		}
+	}
+
+	stats.writes_issued += count;
+	backend->write(ADLIB_write_queue, count);
+}
 
 /* turn off all the voices and restore base octave and (hi) frequency */
-void ADLIB_mute_voices() {
+void AdlibDriver::ADLIB_mute_voices() {
 	// turn off melodic voices
-	for (int i = 0; i < NUM_MELODIC_VOICES; ++i) {
+	for (int i = 0; i < melodic_voices; ++i) {
 		ADLIB_mute_melodic_voice(i);
 	}
 	
@@ -709,14 +1822,15 @@ void ADLIB_mute_voices() {
 }
 
 
-void ADLIB_init_voices() {
+void AdlibDriver::ADLIB_init_voices() {
 	for (int i = 0; i < NUM_MIDI_CHANNELS; ++i) {
 		midi_channels[i].program = 0;
 		midi_channels[i].volume = 127;
 		midi_channels[i].pedal = 0;
+		midi_channels[i].pan = 64;
 	}
 	
-	for (int i = 0; i < NUM_MELODIC_VOICES; ++i) {
+	for (int i = 0; i < melodic_voices; ++i) {
 		melodic[i].key = -1;
 		melodic[i].program = -1;
 		melodic[i].channel = -1;
@@ -727,38 +1841,39 @@ void ADLIB_init_voices() {
 	}
 	
 	// clear out current percussion notes
-	memset(notes_per_percussion, 5, 0xFF);
+	memset(notes_per_percussion, 0xFF, NUM_PERCUSSIONS);
+	
+	memset(channel_levels_volume, 0xFF, sizeof(channel_levels_volume));	// none built yet
 	
 	driver_assigned_voice = 0;
 	driver_timestamp = 0;
+	ADLIB_reset_voice_allocator();
 	driver_percussion_mask = ADLIB_DEFAULT_PERCUSSION_MASK;
 	ADLIB_out(0xBD, driver_percussion_mask);
 }
 
-void ADLIB_turn_off_voice() {
+void AdlibDriver::ADLIB_turn_off_voice() {
 	if (midi_event_channel == 9) {
 		ADLIB_onoff_percussion(false);
 	} else {
-		uint8 voice;	// left uninitialized !
-	
-		if (midi_channels[midi_event_channel].pedal == 0) {
-			voice = 0xFF;	// used below as a flag
-		}
+		/* the original left voice uninitialized when the pedal was down, and muted whatever voice the
+		   stack held if the note was not found */
+		uint32 mask = voice_key_mask[midi_event_channel][midi_onoff_note];
 		
-		for (int i = 0; i < NUM_MELODIC_VOICES; ++i) {
-			if (melodic[i].key == midi_onoff_note && melodic[i].channel == midi_event_channel) {
-				voice = i;
-			}
-		}
-		
-		if (voice != 0xFF) {
-			// mute the channel
-			ADLIB_mute_melodic_voice(voice);
+		if (mask != 0) {
+			// mute the channel (the last voice given the note, as the original scan did)
+			ADLIB_mute_melodic_voice(31 - __builtin_clz(mask));
 		}
 	}
 }
 
-void ADLIB_turn_on_voice() {
+void AdlibDriver::ADLIB_turn_on_voice() {
+	bool timed = stats_timing && midi_onoff_velocity != 0;
+	std::chrono::steady_clock::time_point start;
+	if (timed) {
+		start = std::chrono::steady_clock::now();
+	}
+
 	if (midi_event_channel == 9) {
 		ADLIB_onoff_percussion(midi_onoff_velocity != 0);
 	} else {
@@ -768,9 +1883,16 @@ void ADLIB_turn_on_voice() {
 			ADLIB_turn_on_melodic();		
 		}	
 	}	
+
+	if (midi_onoff_velocity != 0) {
+		stats.note_ons++;
+	}
+	if (timed) {
+		stats.note_on_ns_total += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
 }
 
-void ADLIB_onoff_percussion(bool onoff) {
+void AdlibDriver::ADLIB_onoff_percussion(bool onoff) {
 	if (midi_onoff_note < 35 || midi_onoff_note > 81) {
 		return;
 	}
@@ -780,6 +1902,9 @@ void ADLIB_onoff_percussion(bool onoff) {
 		if (note->valid == 0) {
 			return;
 		}
+		if (driver_percussion_mask & (1 << note->percussion)) {
+			stats.percussion_retriggers++;
+		}
 		if (midi_onoff_note != notes_per_percussion[note->percussion]) {
 			ADLIB_setup_percussion(note);
 			notes_per_percussion[note->percussion] = midi_onoff_note;
@@ -791,7 +1916,22 @@ void ADLIB_onoff_percussion(bool onoff) {
 	}
 }
 
-void ADLIB_program_operator(uint8 operator_offset, OplOperator *data) {
+/* 0xC0 pan bits for the notes of a midi channel, none on OPL2 */
+uint8 AdlibDriver::ADLIB_pan_bits(uint8 midi_channel) {
+	if (!opl3) {
+		return 0;
+	}
+	uint8 pan = midi_channels[midi_channel].pan;
+	if (pan < 43) {
+		return OPL3_PAN_LEFT;
+	}
+	if (pan > 84) {
+		return OPL3_PAN_RIGHT;
+	}
+	return OPL3_PAN_CENTER;
+}
+
+void AdlibDriver::ADLIB_program_operator(uint16 operator_offset, OplOperator *data) {
 	ADLIB_out(0x20 + operator_offset, data->characteristic);
 	ADLIB_out(0x60 + operator_offset, data->attack_decay);
 	ADLIB_out(0x80 + operator_offset, data->sustain_release);
@@ -799,20 +1939,20 @@ void ADLIB_program_operator(uint8 operator_offset, OplOperator *data) {
 	ADLIB_out(0xE0 + operator_offset, data->waveform);
 }
 
-void ADLIB_program_operator_s(uint8 operator_offset, OplOperator *data) {
+void AdlibDriver::ADLIB_program_operator_s(uint16 operator_offset, OplOperator *data) {
 	ADLIB_out(0x40 + operator_offset, data->levels & LEVEL_MASK);
 	ADLIB_out(0x60 + operator_offset, data->attack_decay);
 	ADLIB_out(0x80 + operator_offset, data->sustain_release);		
 }
 
-void ADLIB_set_operator_level(uint8 operator_offset, OplOperator *data, uint8 velocity, uint8 midi_channel, bool full_volume) {
+void AdlibDriver::ADLIB_set_operator_level(uint16 operator_offset, OplOperator *data, uint8 velocity, uint8 midi_channel, bool full_volume) {
 	uint8 scaling_level = data->levels;
 	uint8 program_level = MAXIMUM_LEVEL - (full_volume ? 0 : (data->levels & LEVEL_MASK));
 	uint8 total_level = calc_level(velocity, program_level, midi_channel);
 	ADLIB_out(0x40 + operator_offset, ADLIB_40(scaling_level, total_level));
 }
 
-void ADLIB_setup_percussion(PercussionNote *note) {
+void AdlibDriver::ADLIB_setup_percussion(PercussionNote *note) {
 	if (note->percussion < 4) {
 		// simple percussions (1 operator)
 		driver_percussion_mask &= ~(1 << note->percussion);
@@ -830,12 +1970,12 @@ void ADLIB_setup_percussion(PercussionNote *note) {
 				
 		// feedback / algorithm
 		uint8 voice = 6;
-		ADLIB_out(0xC0 + voice, note->feedback_algo);
+		ADLIB_out(0xC0 + voice, note->feedback_algo | (opl3 ? OPL3_PAN_CENTER : 0));
 	}
 }
 
 
-void ADLIB_play_percussion(PercussionNote *note, uint8 velocity) {
+void AdlibDriver::ADLIB_play_percussion(PercussionNote *note, uint8 velocity) {
 	if (note->percussion < 4) {
 		// simple percussion (1 operator)
 		driver_percussion_mask &= ~(1 << note->percussion);
@@ -875,74 +2015,150 @@ void ADLIB_play_percussion(PercussionNote *note, uint8 velocity) {
 	}
 }
 
-void ADLIB_turn_on_melodic() {
-	// ideal: look for a melodic voice playing the same note with the same program
-	for (int i = 0; i < NUM_MELODIC_VOICES; ++i) {
-		if (melodic[i].channel == midi_event_channel && 
-			melodic[i].program == midi_channels[midi_event_channel].program &&
-			melodic[i].key == midi_onoff_note) {
-			ADLIB_mute_melodic_voice(i);
-			ADLIB_play_melodic_note(i);
-			return;
+/* The melodic voices are tracked with bitmasks: voices not sounding, and voices with each program
+   loaded. The voices also form a list from the least to the most recently used one, so every step of
+   the allocation below takes the same time whatever the number of voices. */
+void AdlibDriver::ADLIB_reset_voice_allocator() {
+	voice_free_mask = 0;
+	memset(voice_program_mask, 0, sizeof(voice_program_mask));
+	memset(voice_key_mask, 0, sizeof(voice_key_mask));
+	memset(channel_voice_mask, 0, sizeof(channel_voice_mask));
+
+	// rebuild the list in timestamp order (voices touched in the same tick in index order)
+	uint8 order[MAX_MELODIC_VOICES];
+	for (int i = 0; i < melodic_voices; ++i) {
+		int j = i;
+		for (; j > 0 && melodic[order[j - 1]].timestamp > melodic[i].timestamp; --j) {
+			order[j] = order[j - 1];
 		}
+		order[j] = i;
 	}
-	
-	// fallback 1: look for a free melodic voice with the same program
-	uint8 voice = driver_assigned_voice;
-	do {
-		driver_assigned_voice = INC_MOD(driver_assigned_voice, NUM_MELODIC_VOICES);
-		
-		if (!melodic[driver_assigned_voice].in_use) {	
-			continue;
+
+	voice_lru_head = 0xFF;
+	voice_lru_tail = 0xFF;
+	for (int i = 0; i < melodic_voices; ++i) {
+		uint8 voice = order[i];
+		voice_lru_prev[voice] = 0xFF;
+		voice_lru_next[voice] = 0xFF;
+		ADLIB_touch_voice(voice);
+
+		if (!melodic[voice].in_use) {
+			voice_free_mask |= 1 << voice;
 		}
-		
-		if (midi_channels[midi_event_channel].program == melodic[driver_assigned_voice].program) {
-			ADLIB_play_melodic_note(driver_assigned_voice);
-			return;
+		if (melodic[voice].program >= 0) {
+			voice_program_mask[melodic[voice].program] |= 1 << voice;
 		}
-	} while (driver_assigned_voice != voice);
+		if (melodic[voice].channel >= 0) {
+			voice_key_mask[melodic[voice].channel][MELODIC_KEY(voice)] |= 1 << voice;
+			channel_voice_mask[melodic[voice].channel] |= 1 << voice;
+		}
+	}
+}
 
-	// fallback 2: look for a free melodic voice
-	do {
-		driver_assigned_voice = INC_MOD(driver_assigned_voice, NUM_MELODIC_VOICES);
+/* moves voice to the most recently used end of the list */
+void AdlibDriver::ADLIB_touch_voice(uint8 voice) {
+	if (voice_lru_tail == voice) {
+		return;
+	}
+
+	// unlink
+	uint8 prev = voice_lru_prev[voice];
+	uint8 next = voice_lru_next[voice];
+	if (prev != 0xFF) {
+		voice_lru_next[prev] = next;
+	} else if (voice_lru_head == voice) {
+		voice_lru_head = next;
+	}
+	if (next != 0xFF) {
+		voice_lru_prev[next] = prev;
+	}
+
+	// append
+	voice_lru_prev[voice] = voice_lru_tail;
+	voice_lru_next[voice] = 0xFF;
+	if (voice_lru_tail != 0xFF) {
+		voice_lru_next[voice_lru_tail] = voice;
+	} else {
+		voice_lru_head = voice;
+	}
+	voice_lru_tail = voice;
+}
+
+/* the first voice in mask after driver_assigned_voice, going round. mask must not be empty. */
+uint8 AdlibDriver::ADLIB_next_voice(uint32 mask) {
+	uint8 start = driver_assigned_voice + 1;
+	uint32 rotated = ((mask >> start) | (mask << (melodic_voices - start))) & ((1 << melodic_voices) - 1);
+	uint8 voice = start + __builtin_ctz(rotated);
+	return voice >= melodic_voices ? voice - melodic_voices : voice;
+}
+
+void AdlibDriver::ADLIB_turn_on_melodic() {
+	uint8 program = midi_channels[midi_event_channel].program;
+
+	// ideal: look for a melodic voice playing the same note with the same program
+	uint32 mask = voice_key_mask[midi_event_channel][midi_onoff_note] & voice_program_mask[program];
+	if (mask != 0) {
+		uint8 voice = __builtin_ctz(mask);
+		ADLIB_TRACE_POINT(kTraceVoice, voice, kTraceVoiceSameNote);
+		ADLIB_mute_melodic_voice(voice);
+		ADLIB_play_melodic_note(voice);
+		return;
+	}
 	
-		if (!melodic[driver_assigned_voice].in_use) {	
-			ADLIB_program_melodic_voice(driver_assigned_voice, midi_channels[midi_event_channel].program);
-			ADLIB_play_melodic_note(driver_assigned_voice);
-			return;		
-		}
-	} while (voice != driver_assigned_voice);
+	// fallback 1: look for a free melodic voice with the same program, no need to program it
+	mask = voice_free_mask & voice_program_mask[program];
+	if (mask != 0) {
+		driver_assigned_voice = ADLIB_next_voice(mask);
+		ADLIB_TRACE_POINT(kTraceVoice, driver_assigned_voice, kTraceVoiceFreeSameProgram);
+		ADLIB_play_melodic_note(driver_assigned_voice);
+		return;
+	}
 
-	// last attempt: look for any voice with the same program
-	driver_assigned_voice = voice;
-	do {
-		driver_assigned_voice = INC_MOD(driver_assigned_voice, NUM_MELODIC_VOICES);
+	// fallback 2: look for a free melodic voice
+	if (voice_free_mask != 0) {
+		driver_assigned_voice = ADLIB_next_voice(voice_free_mask);
+		ADLIB_TRACE_POINT(kTraceVoice, driver_assigned_voice, kTraceVoiceFree);
+		ADLIB_program_melodic_voice(driver_assigned_voice, program);
+		ADLIB_play_melodic_note(driver_assigned_voice);
+		return;
+	}
 
-		if (midi_channels[midi_event_channel].program == melodic[driver_assigned_voice].program) {
-			ADLIB_mute_melodic_voice(driver_assigned_voice);
-			ADLIB_play_melodic_note(driver_assigned_voice);
-			return;
-		}
-	} while (voice != driver_assigned_voice);	
-
-	// forget the good manners and take possession of the voice with the oldest timestamp
-	int32 min_timestamp = 0x7FFFFFFF;
-	for (int i = 0; i < NUM_MELODIC_VOICES; ++i) {
-		if (melodic[i].timestamp < min_timestamp) {
-			min_timestamp = melodic[i].timestamp;
-			driver_assigned_voice = i;
-		}
+	// last attempt: look for any voice with the same program
+	if (voice_program_mask[program] != 0) {
+		driver_assigned_voice = ADLIB_next_voice(voice_program_mask[program]);
+		ADLIB_TRACE_POINT(kTraceVoice, driver_assigned_voice, kTraceVoiceSameProgram);
+		ADLIB_mute_melodic_voice(driver_assigned_voice);
+		ADLIB_play_melodic_note(driver_assigned_voice);
+		return;
 	}
-	ADLIB_program_melodic_voice(driver_assigned_voice, midi_channels[midi_event_channel].program);
+
+	// forget the good manners and take possession of the least recently used voice
+	driver_assigned_voice = voice_lru_head;
+	stats.voice_steals++;
+	ADLIB_TRACE_POINT(kTraceVoice, driver_assigned_voice, kTraceVoiceSteal);
+	ADLIB_program_melodic_voice(driver_assigned_voice, program);
 	ADLIB_play_melodic_note(driver_assigned_voice);
 }
 
-void ADLIB_program_melodic_voice(uint8 voice, uint8 program) {
+void AdlibDriver::ADLIB_program_melodic_voice(uint8 voice, uint8 program) {
+	ADLIB_load_melodic_program(voice, program);
+
+	if (melodic[voice].program >= 0) {
+		voice_program_mask[melodic[voice].program] &= ~(1 << voice);
+	}
+	voice_program_mask[program] |= 1 << voice;
+	melodic[voice].program = program;
+	stats.reprograms++;
+}
+
+/* the register writes of ADLIB_program_melodic_voice() alone, the allocator does not see them */
+void AdlibDriver::ADLIB_load_melodic_program(uint8 voice, uint8 program) {
 	// the original decreases channel by one, but we are already counting from 0
 	MelodicProgram *prg = &melodic_programs[program];
 	
-	uint8 offset1 = operator1_offset_for_melodic[voice];
-	uint8 offset2 = operator2_offset_for_melodic[voice];
+	uint8 channel = melodic_channels[voice];
+	uint16 offset1 = ADLIB_OPERATOR1(channel);
+	uint16 offset2 = ADLIB_OPERATOR2(channel);
 	ADLIB_out(0x40 + offset1, MAXIMUM_LEVEL);
 	ADLIB_out(0x40 + offset2, MAXIMUM_LEVEL);
 
@@ -952,14 +2168,16 @@ void ADLIB_program_melodic_voice(uint8 voice, uint8 program) {
 	ADLIB_program_operator(offset2, &prg->op[1]);
 
 	// feedback / algorithm
-	ADLIB_out(0xC0 + voice, prg->feedback_algo);
+	ADLIB_out(ADLIB_CHANNEL_REG(0xC0, channel), prg->feedback_algo | ADLIB_pan_bits(midi_event_channel));
 }
 
-void ADLIB_mute_melodic_voice(uint8 voice) {
-	ADLIB_out(0xB0 + voice, ADLIB_B0(0, melodic[voice].octave << 2, melodic[voice].fnumber >> 8));
+void AdlibDriver::ADLIB_mute_melodic_voice(uint8 voice) {
+	ADLIB_out(ADLIB_CHANNEL_REG(0xB0, melodic_channels[voice]), ADLIB_B0(0, melodic[voice].octave << 2, melodic[voice].fnumber >> 8));
+	melodic[voice].in_use = false;
+	voice_free_mask |= 1 << voice;
 }
 
-void ADLIB_play_melodic_note(uint8 voice) {
+void AdlibDriver::ADLIB_play_melodic_note(uint8 voice) {
 	uint8 octave = midi_onoff_note / 12;
 	uint8 f = 12 + (midi_onoff_note % 12);
 	if (octave > 7) {
@@ -968,69 +2186,88 @@ void ADLIB_play_melodic_note(uint8 voice) {
 	
 	uint8 program = midi_channels[midi_event_channel].program;
 	MelodicProgram *prg = &melodic_programs[program];
+	uint8 channel = melodic_channels[voice];
 	
 	if (1 & melodic_programs[program].feedback_algo) {
-		ADLIB_set_operator_level(operator1_offset_for_melodic[voice], &prg->op[0], midi_onoff_velocity, midi_event_channel, false);
-		ADLIB_set_operator_level(operator2_offset_for_melodic[voice], &prg->op[1], midi_onoff_velocity, midi_event_channel, false);
+		ADLIB_set_operator_level(ADLIB_OPERATOR1(channel), &prg->op[0], midi_onoff_velocity, midi_event_channel, false);
+		ADLIB_set_operator_level(ADLIB_OPERATOR2(channel), &prg->op[1], midi_onoff_velocity, midi_event_channel, false);
 	} else {
-		ADLIB_set_operator_level(operator2_offset_for_melodic[voice], &prg->op[1], midi_onoff_velocity, midi_event_channel, true);
+		ADLIB_set_operator_level(ADLIB_OPERATOR2(channel), &prg->op[1], midi_onoff_velocity, midi_event_channel, true);
+	}
+
+	if (opl3) {
+		// the voice may have been programmed for another channel
+		ADLIB_out(ADLIB_CHANNEL_REG(0xC0, channel), prg->feedback_algo | ADLIB_pan_bits(midi_event_channel));
 	}
 	
-	ADLIB_play_note(voice, octave, melodic_fnumbers[f]);
+	ADLIB_play_note(channel, octave, melodic_fnumbers[f]);
+
+	if (melodic[voice].channel >= 0) {
+		voice_key_mask[melodic[voice].channel][MELODIC_KEY(voice)] &= ~(1 << voice);
+		channel_voice_mask[melodic[voice].channel] &= ~(1 << voice);
+	}
+	voice_key_mask[midi_event_channel][midi_onoff_note] |= 1 << voice;
+	channel_voice_mask[midi_event_channel] |= 1 << voice;
 
-	melodic[voice].program = program;
 	melodic[voice].key = midi_onoff_note;
 	melodic[voice].channel = midi_event_channel;
 	melodic[voice].timestamp = driver_timestamp;
 	melodic[voice].fnumber = melodic_fnumbers[f];
 	melodic[voice].octave = octave;
 	melodic[voice].in_use = true;
+	voice_free_mask &= ~(1 << voice);
+	ADLIB_touch_voice(voice);
 }
 
-void ADLIB_play_note(uint8 voice, uint8 octave, uint16 fnumber) {
+void AdlibDriver::ADLIB_play_note(uint8 channel, uint8 octave, uint16 fnumber) {
 	/* Percussions are always fed keyOn = 0 even to set the note, as they are activated using the
 	   BD register instead. I wonder if they can just be fed the same value as melodic voice and
 	   be done with it. */
-	uint8 keyOn = (voice < NUM_MELODIC_VOICES) ? 0x20 : 0;
+	uint8 keyOn = (channel >= 6 && channel <= 8) ? 0 : 0x20;
 
-	ADLIB_out(0xB0 + voice, ADLIB_B0(keyOn, octave << 2, fnumber >> 8));
-	ADLIB_out(0xA0 + voice, fnumber & 0xFF);
+	ADLIB_out(ADLIB_CHANNEL_REG(0xB0, channel), ADLIB_B0(keyOn, octave << 2, fnumber >> 8));
+	ADLIB_out(ADLIB_CHANNEL_REG(0xA0, channel), fnumber & 0xFF);
 }
 
-void ADLIB_pitch_bend(int amount, uint8 midi_channel) {
+void AdlibDriver::ADLIB_pitch_bend(int amount, uint8 midi_channel) {
 	amount -= PITCH_BEND_THRESH;
 	int16 bend_amount;
 
-	for (int i = 0; i < NUM_MELODIC_VOICES; ++i) {
-		if (melodic[i].channel == midi_channel && melodic[i].in_use) {
-			uint8 f = 12 + melodic[i].key % 12;	// index to fnumber
-			if (amount > 0) {
-				// bend up two semitones
-				bend_amount = (amount * (melodic_fnumbers[f+2] - melodic_fnumbers[f])) / PITCH_BEND_THRESH;
-			} else {
-				// bend down two semitones
-				bend_amount = (amount * (melodic_fnumbers[f] - melodic_fnumbers[f-2])) / PITCH_BEND_THRESH;					
-			}
-			bend_amount += melodic_fnumbers[f];	// add the base frequency
-			ADLIB_play_note(i, melodic[i].octave, bend_amount);
-			melodic[i].timestamp = driver_timestamp;
+	// the sounding voices of the channel, in voice order
+	for (uint32 mask = channel_voice_mask[midi_channel] & ~voice_free_mask; mask != 0; mask &= mask - 1) {
+		int i = __builtin_ctz(mask);
+		uint8 f = 12 + melodic[i].key % 12;	// index to fnumber
+		if (amount > 0) {
+			// bend up two semitones
+			bend_amount = (amount * (melodic_fnumbers[f+2] - melodic_fnumbers[f])) / PITCH_BEND_THRESH;
+		} else {
+			// bend down two semitones
+			bend_amount = (amount * (melodic_fnumbers[f] - melodic_fnumbers[f-2])) / PITCH_BEND_THRESH;					
 		}
+		bend_amount += melodic_fnumbers[f];	// add the base frequency
+		ADLIB_play_note(melodic_channels[i], melodic[i].octave, bend_amount);
+		melodic[i].timestamp = driver_timestamp;
+		ADLIB_touch_voice(i);
 	}
 }
 
-void ADLIB_init() {
+void AdlibDriver::ADLIB_init() {
+	// the chip state is unknown until each register has been written once
+	ADLIB_reset_register_cache();
+	
 	ADLIB_out(0x1, 0x80);	// ???
 	ADLIB_out(0x1, 0x20);	// enable all waveforms
-
-	// logarithmic map [0 -> 0, 1..128 -> 1..256] (driver volume to hw volume?)
-	for (int i = 0; i < 129; ++i) {
-		ADLIB_log_volume[i] = (uint32)round(256.0f * (log((float)i+1.0f) / log(128.0f)));
-	}
 	
-	for (int i = 0; i < NUM_VOICES; ++i) {
-		ADLIB_out(0xA0 + i, 0);
-		ADLIB_out(0xB0 + i, 0);
-		ADLIB_out(0xC0 + i, 0);
+	if (opl3) {
+		ADLIB_out(0x105, 1);	// OPL3 mode: second bank and pan
+		ADLIB_out(0x104, 0);	// 2 operator channels only
+	}
+
+	// OPL3 channels stay silent until routed to a side
+	for (int i = 0; i < (opl3 ? 2 * NUM_VOICES : NUM_VOICES); ++i) {
+		ADLIB_out(ADLIB_CHANNEL_REG(0xA0, i), 0);
+		ADLIB_out(ADLIB_CHANNEL_REG(0xB0, i), 0);
+		ADLIB_out(ADLIB_CHANNEL_REG(0xC0, i), opl3 ? OPL3_PAN_CENTER : 0);
 	}
 	
 	driver_assigned_voice = 0;
@@ -1038,11 +2275,11 @@ void ADLIB_init() {
 	ADLIB_out(0xBD, driver_percussion_mask);
 }
 
-void ADLIB_tick() {
+void AdlibDriver::ADLIB_tick() {
 	driver_timestamp++;
 }
 
-void ADLIB_modulation(int value) {
+void AdlibDriver::ADLIB_modulation(int value) {
 	if (value >= 64) {
 		driver_percussion_mask |= 0x80;
 	} else {
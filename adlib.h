@@ -0,0 +1,412 @@
+#ifndef ADLIB_H
+#define ADLIB_H
+
+#include <atomic>
+#include <vector>
+
+typedef unsigned char 	uint8;
+typedef signed char		int8;
+typedef unsigned short	uint16;
+typedef signed short	int16;
+typedef unsigned int 	uint32;
+typedef signed int		int32;
+typedef unsigned long long	uint64;
+typedef signed long long	int64;
+
+/**********************************
+	platform interface
+*/
+
+struct OplWrite {
+	int32 tick;		// driver_timestamp at the time of the write
+	uint16 command;	// 0x100-0x1FF is the second bank of an OPL3
+	uint8 value;
+};
+
+class AdlibBackend {
+public:
+	virtual ~AdlibBackend() {}
+
+	// the actual port writes. Writes in one batch belong to the same tick.
+	virtual void write(const OplWrite *writes, uint16 count) = 0;
+
+	// the driver tick rate in Hz, reset_timer() restores the system one
+	virtual void set_timer(uint16 clock) = 0;
+	virtual void reset_timer() = 0;
+
+	/* the exact tick length that the last set_timer() rounds to whole Hz: division ticks per
+	   quarter_us microseconds. Backends on a virtual clock can time ticks with it. */
+	virtual void set_tick_period(uint32 quarter_us, uint16 division) {}
+};
+
+/* Feeds a song to the driver in chunks, in place of midi_buffer. */
+class AdlibSongSource {
+public:
+	virtual ~AdlibSongSource() {}
+
+	// copies up to size bytes of the song to buffer and returns the count, 0 only at the end of the song
+	virtual uint32 refill(uint8 *buffer, uint32 size) = 0;
+
+	// back to the start of the song, for looping. False if the source cannot.
+	virtual bool rewind() { return false; }
+
+	// copies up to size bytes from offset in the song and returns the count, 0 past its end or if the
+	// source cannot. Each track of a type 1 file is read at its own place this way, which may move
+	// where refill() goes on.
+	virtual uint32 read(uint32 offset, uint8 *buffer, uint32 size) { return 0; }
+};
+
+
+/**********************************
+	driver
+*/
+
+#define NUM_MIDI_CHANNELS		15
+
+#define NUM_VOICES				9		// the driver only uses rhythm mode, so there are 9 FM voices available
+
+#define NUM_MELODIC_VOICES		6		// adlib FM voices 0-5	(2 operators each)
+#define NUM_PERCUSSIONS			5		// adlib FM voice 6 	(2 operators), and voices 7-8 (1 operator each)
+
+#define MAX_MELODIC_VOICES		15		// OPL3: voices 0-5 of the first bank and all 9 of the second
+#define NUM_REGISTERS			512		// both OPL3 banks
+
+#define WRITE_QUEUE_SIZE		512
+
+#define CHECKPOINT_INTERVAL		1024	// driver ticks between seek checkpoints
+
+#define MIDI_STREAM_SIZE		4096	// ring for streamed songs, power of 2
+
+#define SMF_MAX_DIVISION		15360	// keeps the timer rate (tempo * division) / 60 in 16 bits
+#define SMF_TRACK_BUFFER		256		// read ahead in each track of a streamed type 1 file
+
+enum DriverStatus {
+	kStatusStopped,
+	kStatusPlaying,
+	kStatusPaused
+};
+
+struct MidiChannel {
+	uint8 program;
+	uint8 volume;
+	uint8 pedal;
+	uint8 pan;
+};
+
+struct MelodicVoice {
+	int8 key;			// the note being played
+	int8 program;		// the midi instrument? (see voice)
+	int8 channel;		// the midi channel
+	int32 timestamp;
+	uint16 fnumber;		// frequency id (see lookup table)
+	int8 octave;
+	bool in_use;
+};
+
+// a decoded song event
+struct MidiEvent {
+	uint32 tick;		// absolute
+	uint8 status;		// channel event status, or 255 for tempo
+	uint8 data1;		// key, program, controller number, or bits 16-23 of the tempo
+	uint16 data2;		// velocity, controller value, pitch bend, or bits 0-15 of the tempo
+};						// (tempo in microseconds per quarter note)
+
+// a track of a standard MIDI file, read where it is
+struct MidiTrack {
+	uint32 pos;			// next byte, from the start of the song
+	uint32 end;			// pos > end if the last event was cut short
+	uint32 tick;		// of the next event
+	uint8 status;		// for running status
+	uint32 buffer_pos;	// where the bytes read ahead start, streamed type 1 only
+	uint32 buffer_len;
+};
+
+struct TempoChange {
+	uint32 tick;		// of the event
+	uint8 tempo;		// in bpm
+	uint32 quarter_us;	// exact
+};
+
+// what a song needs, found without playing it
+struct SongAnalysis {
+	uint32 programs[NUM_MIDI_CHANNELS][4];	// programs of the notes of each channel, one bit per program
+	uint8 peak_polyphony;					// most melodic notes held at once
+	uint64 percussion_notes;				// bit n: drum key 35 + n played on channel 9
+	std::vector<TempoChange> tempo_map;		// the header tempo at tick 0, then the tempo events
+	uint32 length_ticks;
+	uint32 length_ms;
+};
+
+// driver state at the start of a tick, taken while the song is loaded
+struct DriverCheckpoint {
+	uint32 position;
+	uint32 event_index;
+	uint32 event_delta;
+	uint8 tempo;
+	uint32 quarter_us;
+	MidiChannel channels[NUM_MIDI_CHANNELS];
+	MelodicVoice melodic[MAX_MELODIC_VOICES];
+	uint8 notes_per_percussion[NUM_PERCUSSIONS];
+	uint8 percussion_mask;
+	int32 timestamp;
+	uint8 assigned_voice;
+	uint8 registers[NUM_REGISTERS];
+	uint32 registers_valid[NUM_REGISTERS / 32];
+};
+
+// counters since midi_init() or the last midi_reset_stats()
+struct DriverStats {
+	uint32 events;					// song events played
+	uint32 note_ons;				// notes that went to the voice allocator or to the percussions
+	uint32 writes_issued;			// register writes sent to the chip
+	uint32 writes_elided;			// dropped because the chip already held the value, or overwritten in the same tick
+	uint32 voice_steals;			// notes that took the least recently used voice from a sounding note
+	uint32 reprograms;				// instruments loaded into melodic voices
+	uint32 percussion_retriggers;	// drum notes that cut the same drum short
+	uint32 fade_steps;				// volume changes of fades in and out
+	uint32 timed_ticks;				// ticks measured while stats_timing is set
+	uint32 tick_ns_max;
+	uint64 tick_ns_total;			// tick_ns_total / timed_ticks is the average
+	uint64 note_on_ns_total;		// spent on note ons while stats_timing is set, one clock read included in each
+};
+
+// what the driver publishes after every tick for other threads to read
+struct DriverSnapshot {
+	uint32 position;		// in ticks
+	uint32 length;
+	uint8 status;			// DriverStatus
+	uint8 volume;			// current, fades included
+	uint8 fade_in_flag;
+	uint8 fade_out_flag;
+	uint8 fading;			// 1 while fading in, 2 while fading out
+	uint8 fade_rate;
+	uint8 tempo;
+	uint8 loop;
+	uint8 active_voices;	// keyed on melodic voices and percussions
+	uint8 programs[NUM_MIDI_CHANNELS];
+	DriverStats stats;
+};
+
+struct OplOperator;
+struct PercussionNote;
+
+/* One song on one chip. Instances share nothing but the static instrument data, so independent
+   instances can run on different threads. */
+class AdlibDriver {
+public:
+	AdlibDriver(AdlibBackend *backend, bool opl3 = false);
+
+	void midi_init();
+	void midi_driver();		// once per timer tick
+	uint32 midi_idle_ticks();
+	uint32 midi_advance(uint32 ticks);
+	void midi_resume();
+	void midi_pause();
+	void midi_stop();
+	void midi_fadeout_and_stop();
+	void midi_set_tempo();
+	void midi_set_fade_rate(uint8 rate);
+	bool midi_seek(uint32 position);	// jump to a tick of the loaded song
+	void midi_set_source(AdlibSongSource *source);	// stream the songs from source, 0 for midi_buffer
+	void midi_analyze_song();	// fills midi_analysis for the song in midi_buffer, while stopped; the next midi_resume() plays what it decoded
+
+	// what decides how the song goes on from here, and whether the driver is back in such a state
+	void midi_save_state(DriverCheckpoint *state);
+	bool midi_in_state(const DriverCheckpoint *state);
+
+	void ADLIB_mute_voices();
+
+	void midi_reset_stats();
+	void midi_read_snapshot(DriverSnapshot *snapshot) const;	// safe from any thread
+
+	DriverStatus driver_status;
+	bool driver_installed;
+
+	// fixed at construction
+	bool opl3;					// use the second bank of an OPL3 for 9 more melodic voices, and pan
+	uint8 melodic_voices;		// NUM_MELODIC_VOICES or MAX_MELODIC_VOICES
+
+	// set by the client
+	const uint8 *midi_buffer;
+	uint32 midi_buffer_size;
+	bool midi_loop;
+	uint8 midi_volume;	// coarse volume
+	bool midi_fade_out_flag;
+	bool midi_fade_in_flag;
+	uint8 midi_fade_volume_change_rate;
+	uint8 midi_tempo;
+	bool stats_timing;	// time every midi_driver() call, at the cost of two clock reads
+
+	MidiChannel midi_channels[NUM_MIDI_CHANNELS];
+
+	// set by the driver
+	uint32 midi_position;	// ticks since the start of the song
+	uint32 midi_length;		// in ticks, known once the song is loaded (never for a streamed one)
+	uint32 midi_quarter_us;	// the exact tempo, in microseconds per quarter note
+	uint32 midi_loops;		// times the song has started over since midi_resume()
+	SongAnalysis midi_analysis;	// of the loaded song (not of a streamed one)
+
+	DriverStats stats;
+
+private:
+	AdlibBackend *backend;
+
+	// midi driver
+	uint8 read_midi_byte();
+	uint16 read_midi_word();
+	uint32 read_midi_VLQ();
+	bool midi_input_left();
+	bool midi_input_overrun();
+	void midi_skip_input(uint32 count);
+	void midi_unread_byte();
+	void midi_read_header();
+	bool midi_decode_event(MidiEvent *event);
+	void midi_read_smf_header();
+	uint8 midi_track_byte(MidiTrack *track);
+	uint32 midi_track_VLQ(MidiTrack *track);
+	void midi_track_skip(MidiTrack *track, uint32 count);
+	bool midi_decode_track_event(MidiTrack *track, MidiEvent *event);
+	bool midi_decode_smf_event(MidiEvent *event);
+	bool midi_track_before(uint16 a, uint16 b);
+	void midi_track_sift_down(uint32 index);
+	void midi_load();
+	bool midi_song_loaded();
+	void midi_analyze();
+	void midi_preload();
+	const MidiEvent *midi_peek_event();
+	void midi_pop_event();
+	bool midi_rewind();
+	bool midi_stream_refill();
+	void midi_stream_start();
+	void midi_start_checkpoints();
+	void midi_save_checkpoint(DriverCheckpoint *checkpoint);
+	void midi_restore_checkpoint(const DriverCheckpoint *checkpoint);
+	void midi_fast_forward(uint32 position);
+	void midi_publish_snapshot();
+	void process_midi_event(const MidiEvent *event);
+	void midi_process_events();
+
+	// OPL
+	void ADLIB_init();
+	void ADLIB_tick();
+	void ADLIB_init_voices();
+	void ADLIB_turn_on_voice();
+	void ADLIB_turn_off_voice();
+	void ADLIB_pitch_bend(int amount, uint8 midi_channel);
+	void ADLIB_modulation(int value);
+	uint8 calc_level(uint8 velocity, uint8 program_level, uint8 midi_channel);
+	void ADLIB_build_channel_levels(uint8 midi_channel);
+	void ADLIB_play_note(uint8 channel, uint8 octave, uint16 fnumber);
+	void ADLIB_play_melodic_note(uint8 voice);
+	void ADLIB_mute_melodic_voice(uint8 voice);
+	void ADLIB_program_melodic_voice(uint8 voice, uint8 program);
+	void ADLIB_load_melodic_program(uint8 voice, uint8 program);
+	void ADLIB_turn_on_melodic();
+	void ADLIB_reset_voice_allocator();
+	void ADLIB_touch_voice(uint8 voice);
+	uint8 ADLIB_next_voice(uint32 mask);
+	uint8 ADLIB_pan_bits(uint8 midi_channel);
+	void ADLIB_program_operator(uint16 operator_offset, OplOperator *data);
+	void ADLIB_program_operator_s(uint16 operator_offset, OplOperator *data);
+	void ADLIB_set_operator_level(uint16 operator_offset, OplOperator *data, uint8 velocity, uint8 midi_channel, bool full_volume);
+	void ADLIB_play_percussion(PercussionNote *note, uint8 velocity);
+	void ADLIB_setup_percussion(PercussionNote *note);
+	void ADLIB_onoff_percussion(bool onoff);
+
+	// register writes
+	void ADLIB_reset_register_cache();
+	void ADLIB_out(uint16 command, uint8 value);
+	void ADLIB_flush();
+	void ADLIB_refresh();
+
+	uint32 midi_buffer_pos;
+
+	std::vector<MidiEvent> midi_events;
+	uint32 midi_event_index;	// next event to play
+	const uint8 *midi_loaded_buffer;	// the song midi_analyze_song() decoded, 0 once midi_resume() took it
+	uint32 midi_loaded_size;
+	std::vector<uint16> midi_preload_list;	// channel << 8 | program of a melodic note, or 0x8000 | key of a drum
+
+	uint32 midi_decode_tick;	// of the last event decoded
+	uint8 midi_decode_status;	// for running status
+
+	/* Standard MIDI files (type 0 and 1) are played as they are: each track is read in place with
+	   its own running status, and the tracks are merged through a heap on the tick of their next
+	   event. A streamed file with more than one track reads each from the source at its own place,
+	   through SMF_TRACK_BUFFER bytes of its own. */
+	bool midi_smf;
+	std::vector<MidiTrack> midi_tracks;
+	std::vector<uint16> midi_track_heap;	// tracks with events left, the one due first on top
+	bool midi_track_cursors;	// the tracks are read with AdlibSongSource::read()
+	std::vector<uint8> midi_track_buffers;	// SMF_TRACK_BUFFER bytes per track
+
+	/* Streamed songs are decoded one event ahead of playback, from a ring that is refilled from the
+	   source whenever it runs dry, so memory stays the same whatever the length of the song. */
+	AdlibSongSource *midi_source;
+	uint8 midi_stream_buffer[MIDI_STREAM_SIZE];
+	uint32 midi_stream_head;	// bytes ever written to the ring
+	uint32 midi_stream_tail;	// bytes ever read from it
+	bool midi_stream_overrun;	// a read went past the end of the song
+	MidiEvent midi_stream_event;	// next event to play
+	bool midi_stream_event_valid;
+
+	uint16 midi_division;	// in ppqn
+	uint32 midi_event_delta;	// ticks to wait before the next event
+	std::vector<DriverCheckpoint> midi_checkpoints;	// one every CHECKPOINT_INTERVAL ticks, as far as a seek went
+	bool midi_fast_forwarding;	// nothing is heard or published
+
+	// seqlock: odd while the snapshot is being written
+	std::atomic<uint32> snapshot_sequence;
+	std::atomic<uint32> snapshot_words[(sizeof(DriverSnapshot) + 3) / 4];
+	uint8  midi_event_channel;
+	uint8  midi_onoff_note;
+	uint8  midi_onoff_velocity;
+	int16 midi_pitch_bend;
+
+	// fade in
+	bool driver_fading_in;
+	uint32 fadein_volume_cur;
+	uint32 fadein_volume_inc;
+
+	// fade out
+	bool driver_fading_out;
+	uint32 fadeout_volume_cur;
+	uint32 fadeout_volume_dec;
+
+	// internal fine volume
+	uint16 full_volume;
+
+	MelodicVoice melodic[MAX_MELODIC_VOICES];
+
+	// notes being currently played for each percussion (0xFF if none)
+	uint8 notes_per_percussion[NUM_PERCUSSIONS];
+
+	uint8 driver_percussion_mask;
+
+	int32 driver_timestamp;
+
+	uint8 driver_assigned_voice;		// last voice assigned to a channel
+
+	// melodic voice allocation, one bit per voice
+	uint32 voice_free_mask;				// voices not sounding
+	uint32 voice_program_mask[128];		// voices with each program loaded
+	uint8 voice_lru_prev[MAX_MELODIC_VOICES];	// from the least to the most recently used voice
+	uint8 voice_lru_next[MAX_MELODIC_VOICES];
+	uint8 voice_lru_head, voice_lru_tail;
+	uint32 voice_key_mask[NUM_MIDI_CHANNELS][128];	// voices given each key by each channel
+	uint32 channel_voice_mask[NUM_MIDI_CHANNELS];	// voices given a note by each channel
+
+	// levels for each velocity, by channel
+	uint32 channel_levels[NUM_MIDI_CHANNELS][129];
+	uint16 channel_levels_volume[NUM_MIDI_CHANNELS];	// volume the row was built for, 0xFFFF if none
+
+	OplWrite ADLIB_write_queue[WRITE_QUEUE_SIZE];
+	uint16 ADLIB_write_queue_len;
+	int16 ADLIB_write_queue_slot[NUM_REGISTERS];	// pending write for each register (-1 if none)
+
+	// shadow copy of the chip registers, used to drop writes that would not change anything
+	uint8 ADLIB_registers[NUM_REGISTERS];
+	uint32 ADLIB_registers_valid[NUM_REGISTERS / 32];	// one bit per register, set once it has been written
+};
+
+#endif
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "adlib.h"
+#include "loadfile.h"
+
+/**********************************
+	driver benchmark
+
+	Times the sequencer and the voice allocator on their own: the backend only
+	counts the writes, nothing is synthesized. Every song is played from the top
+	with one midi_driver() call per tick, repeat times, and the fastest run is
+	kept. note_on_ns comes from a separate run with stats_timing set, which
+	times each note on alone (the allocator or the percussions).
+
+	usage: bench [-3] [-n repeat] [song ...]
+
+	Without songs it plays the synthetic ones below. They come from a fixed
+	seed, so two builds always play the very same events. The results go to
+	stdout as one tab separated line per song, after a header line.
+*/
+
+#define DEFAULT_REPEAT		5
+
+#define SYNTH_SEED			0x2545F491
+#define SYNTH_TEMPO			120
+#define SYNTH_DIVISION		96
+#define SYNTH_TICKS			(SYNTH_DIVISION * 2 * 240)	// 4 minutes at 120 bpm
+
+typedef std::chrono::steady_clock Clock;
+
+
+/**********************************
+	synthetic songs
+*/
+
+struct SongWriter {
+	std::vector<uint8> data;
+	uint32 tick;		// of the last event written
+	uint32 random;		// xorshift state
+
+	SongWriter() : tick(0), random(SYNTH_SEED) {
+		const uint8 header[7] = { 'M', 'S', 'C', 'M', SYNTH_TEMPO, SYNTH_DIVISION & 0xFF, SYNTH_DIVISION >> 8 };
+		data.assign(header, header + sizeof(header));
+	}
+
+	uint32 next(uint32 range) {
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		return random % range;
+	}
+
+	// events must come in tick order
+	void event(uint32 at, uint8 status, uint8 data1, uint8 data2, bool has_data2 = true) {
+		uint32 delta = at - tick;
+		while (delta > 0xFFFF) {
+			// stretch long gaps with a meta event the driver drops
+			const uint8 filler[5] = { 0xFF, 0xFF, 0xFF, 1, 0 };
+			data.insert(data.end(), filler, filler + sizeof(filler));
+			delta -= 0xFFFF;
+		}
+		data.push_back(delta & 0xFF);
+		data.push_back(delta >> 8);
+		data.push_back(status);
+		data.push_back(data1);
+		if (has_data2) {
+			data.push_back(data2);
+		}
+		tick = at;
+	}
+
+	void note(uint32 at, uint8 channel, uint8 key, uint8 velocity) {
+		event(at, 0x90 | channel, key, velocity);
+	}
+
+	void program(uint32 at, uint8 channel, uint8 program) {
+		event(at, 0xC0 | channel, program, 0, false);
+	}
+};
+
+/* an arrangement: a drum track, a bass line and chords that leave room for a melody */
+void synth_song(SongWriter *w) {
+	static const uint8 chords[4] = { 48, 53, 55, 45 };
+	static const uint8 drums[4] = { 36, 42, 38, 42 };
+	const uint32 beat = SYNTH_DIVISION;
+
+	w->program(0, 0, 0);
+	w->program(0, 1, 33);
+	w->program(0, 2, 48);
+	for (uint32 t = 0; t < SYNTH_TICKS; t += beat) {
+		uint8 root = chords[(t / (4 * beat)) % 4];
+		w->note(t, 9, drums[(t / beat) % 4], 100);
+		w->note(t, 1, root - 12, 90);
+		if ((t / beat) % 4 == 0) {
+			w->note(t, 2, root, 70);
+			w->note(t, 2, root + 4, 70);
+			w->note(t, 2, root + 7, 70);
+		}
+		uint8 key = root + 12 + w->next(12);
+		w->note(t, 0, key, 80 + w->next(40));
+		w->note(t + beat / 2, 9, drums[(t / beat) % 4], 0);
+		w->note(t + beat / 2, 0, key, 0);
+		w->note(t + beat - 1, 1, root - 12, 0);
+		if ((t / beat) % 4 == 3) {
+			w->note(t + beat - 1, 2, root, 0);
+			w->note(t + beat - 1, 2, root + 4, 0);
+			w->note(t + beat - 1, 2, root + 7, 0);
+		}
+	}
+}
+
+/* eight note chords on three channels, twice a beat: more notes than voices all the time */
+void synth_chords(SongWriter *w) {
+	const uint32 step = SYNTH_DIVISION / 2;
+	uint8 keys[8];
+
+	for (int c = 0; c < 3; ++c) {
+		w->program(0, c, c * 20);
+	}
+	for (uint32 t = 0; t < SYNTH_TICKS; t += step) {
+		uint8 channel = (t / step) % 3;
+		for (int i = 0; i < 8; ++i) {
+			keys[i] = 36 + w->next(48);
+			w->note(t, channel, keys[i], 64 + w->next(64));
+		}
+		for (int i = 0; i < 8; ++i) {
+			w->note(t + step - 1, channel, keys[i], 0);
+		}
+	}
+}
+
+/* held notes with a pitch bend on every tick */
+void synth_bends(SongWriter *w) {
+	for (int c = 0; c < 3; ++c) {
+		w->program(0, c, 80 + c);
+		w->note(0, c, 60 + 4 * c, 100);
+		w->note(0, c, 48 + 4 * c, 100);
+	}
+	for (uint32 t = 1; t < SYNTH_TICKS; ++t) {
+		uint32 bend = 0x2000 + ((t % 256) < 128 ? (t % 128) : 128 - (t % 128)) * 32;
+		w->event(t, 0xE0 | (t % 3), 0x80 | (bend >> 7), bend & 0x7F);	// read as a VLQ
+	}
+}
+
+/* a program change before every note, so that voices are reprogrammed all the time */
+void synth_programs(SongWriter *w) {
+	const uint32 step = SYNTH_DIVISION / 8;
+	uint8 keys[4] = { 0, 0, 0, 0 };
+
+	for (uint32 t = 0; t < SYNTH_TICKS; t += step) {
+		uint8 channel = (t / step) % 4;
+		if (keys[channel]) {
+			w->note(t, channel, keys[channel], 0);
+		}
+		w->program(t, channel, w->next(128));
+		keys[channel] = 36 + w->next(48);
+		w->note(t, channel, keys[channel], 100);
+	}
+}
+
+/* sixteenth notes on channel 9, with every drum of the kit */
+void synth_drums(SongWriter *w) {
+	const uint32 step = SYNTH_DIVISION / 4;
+
+	for (uint32 t = 0; t < SYNTH_TICKS; t += step) {
+		uint8 count = 1 + w->next(3);
+		uint8 keys[3];
+		for (int i = 0; i < count; ++i) {
+			keys[i] = 35 + w->next(47);
+			w->note(t, 9, keys[i], 64 + w->next(64));
+		}
+		for (int i = 0; i < count; ++i) {
+			w->note(t + step / 2, 9, keys[i], 0);
+		}
+	}
+}
+
+/* note on after note on and never a note off: once the first notes are in, every note takes a busy
+   voice, which is the slowest path of the allocator */
+void synth_steal(SongWriter *w) {
+	for (int c = 0; c < 8; ++c) {
+		w->program(0, c, 16 * c);
+	}
+	for (uint32 t = 0; t < SYNTH_TICKS; ++t) {
+		w->note(t, w->next(8), 24 + w->next(72), 100);
+	}
+}
+
+struct SynthSong {
+	const char *name;
+	void (*generate)(SongWriter *w);
+};
+
+static const SynthSong synth_songs[] = {
+	{ "synth-song", synth_song },
+	{ "synth-chords", synth_chords },
+	{ "synth-bends", synth_bends },
+	{ "synth-programs", synth_programs },
+	{ "synth-drums", synth_drums },
+	{ "synth-steal", synth_steal },
+};
+
+
+/**********************************
+	measurement
+*/
+
+// counts what would have been sent to the chip
+class CountingBackend : public AdlibBackend {
+public:
+	CountingBackend() : writes(0), clock(0) {}
+
+	void write(const OplWrite *batch, uint16 count) {
+		writes += count;
+	}
+	void set_timer(uint16 clock) {
+		this->clock = clock;
+	}
+	void reset_timer() {}
+
+	uint64 writes;
+	uint16 clock;
+};
+
+struct BenchResult {
+	uint32 ticks;
+	uint32 events;		// note ons, the calls to the allocator or to the percussions
+	double note_on_ns;	// average time of one, clock read included
+	double music_seconds;
+	uint64 writes;
+	uint32 writes_elided;
+	uint32 voice_steals;
+	uint32 reprograms;
+	double seconds;		// the fastest run
+};
+
+void start_song(AdlibDriver *driver, const std::vector<uint8> &song) {
+	driver->midi_init();
+	driver->driver_installed = true;
+	driver->midi_buffer = &song[0];
+	driver->midi_buffer_size = song.size();
+	driver->midi_resume();
+}
+
+bool bench_song(const std::vector<uint8> &song, bool opl3, int repeat, BenchResult *result) {
+	CountingBackend backend;
+	AdlibDriver *driver = new AdlibDriver(&backend, opl3);
+
+	// untimed run for the counts, the time of the note ons alone, and the length of the music at the
+	// tempo of each tick
+	start_song(driver, song);
+	driver->stats_timing = true;
+	if (driver->driver_status != kStatusPlaying) {
+		delete driver;
+		return false;
+	}
+	backend.writes = 0;
+	result->ticks = 0;
+	result->music_seconds = 0;
+	while (driver->driver_status == kStatusPlaying) {
+		driver->midi_driver();
+		result->ticks++;
+		result->music_seconds += backend.clock ? 1.0 / backend.clock : 0.0;
+	}
+	result->writes = backend.writes;
+	result->writes_elided = driver->stats.writes_elided;
+	result->voice_steals = driver->stats.voice_steals;
+	result->reprograms = driver->stats.reprograms;
+	result->events = driver->stats.note_ons;
+	result->note_on_ns = driver->stats.note_ons ? (double)driver->stats.note_on_ns_total / driver->stats.note_ons : 0.0;
+	driver->stats_timing = false;
+
+	result->seconds = 0;
+	for (int i = 0; i < repeat; ++i) {
+		start_song(driver, song);
+
+		Clock::time_point start = Clock::now();
+		while (driver->driver_status == kStatusPlaying) {
+			driver->midi_driver();
+		}
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+		if (i == 0 || elapsed < result->seconds) {
+			result->seconds = elapsed;
+		}
+	}
+
+	delete driver;
+	return true;
+}
+
+void print_header() {
+	printf("song\topl3\tticks\tnote_ons\tmusic_s\twrites\twrites_elided\tvoice_steals\treprograms\tbest_s\tticks_per_s\tns_per_tick\tnote_on_ns\twrites_per_music_s\n");
+}
+
+void print_result(const char *name, bool opl3, const BenchResult *r) {
+	double seconds = r->seconds > 0 ? r->seconds : 1e-9;
+	printf("%s\t%d\t%u\t%u\t%.3f\t%llu\t%u\t%u\t%u\t%.6f\t%.0f\t%.1f\t%.1f\t%.1f\n",
+		name, opl3 ? 1 : 0, r->ticks, r->events, r->music_seconds, (unsigned long long)r->writes, r->writes_elided, r->voice_steals, r->reprograms,
+		r->seconds, r->ticks / seconds, 1e9 * seconds / (r->ticks ? r->ticks : 1),
+		r->note_on_ns,
+		r->music_seconds > 0 ? r->writes / r->music_seconds : 0.0);
+}
+
+
+int main(int argc, char **argv) {
+	bool opl3 = false;
+	int repeat = DEFAULT_REPEAT;
+
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+		if (!strcmp(argv[arg], "-n") && arg + 1 < argc) {
+			repeat = atoi(argv[++arg]);
+		} else if (!strcmp(argv[arg], "-3")) {
+			opl3 = true;
+		} else {
+			fprintf(stderr, "usage: %s [-3] [-n repeat] [song ...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (repeat <= 0) {
+		repeat = 1;
+	}
+
+	print_header();
+	int failed = 0;
+	BenchResult result;
+
+	if (arg == argc) {
+		for (size_t i = 0; i < sizeof(synth_songs) / sizeof(synth_songs[0]); ++i) {
+			SongWriter w;
+			synth_songs[i].generate(&w);
+			if (bench_song(w.data, opl3, repeat, &result)) {
+				print_result(synth_songs[i].name, opl3, &result);
+			} else {
+				failed++;
+			}
+		}
+	}
+
+	for (; arg < argc; ++arg) {
+		std::vector<uint8> song;
+		if (!load_file(argv[arg], song) || song.size() < 10 || !bench_song(song, opl3, repeat, &result)) {
+			fprintf(stderr, "cannot play %s\n", argv[arg]);
+			failed++;
+			continue;
+		}
+		print_result(argv[arg], opl3, &result);
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "adlib.h"
+#include "loadfile.h"
+#include "regstream.h"
+
+/**********************************
+	song compiler
+
+	Plays a song through the driver once and saves the register writes as a
+	stream that render, or any RegStreamPlayer, replays without the driver.
+
+	usage: compile [-3] song out.mso
+*/
+
+int main(int argc, char **argv) {
+	bool opl3 = false;
+
+	int arg = 1;
+	if (arg < argc && !strcmp(argv[arg], "-3")) {
+		opl3 = true;
+		arg++;
+	}
+	if (argc - arg != 2) {
+		fprintf(stderr, "usage: %s [-3] song out.mso\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<uint8> song;
+	std::vector<uint8> stream;
+	if (!load_file(argv[arg], song) || song.size() < 10 || !regstream_compile(&song[0], song.size(), opl3, stream)) {
+		fprintf(stderr, "cannot play %s\n", argv[arg]);
+		return 1;
+	}
+
+	FILE *f = fopen(argv[arg + 1], "wb");
+	if (!f || fwrite(&stream[0], 1, stream.size(), f) != stream.size()) {
+		fprintf(stderr, "cannot write %s\n", argv[arg + 1]);
+		if (f) {
+			fclose(f);
+		}
+		return 1;
+	}
+	fclose(f);
+
+	printf("%s: %u bytes, %u ticks, %u bytes compiled\n", argv[arg], (uint32)song.size(),
+		stream[8] | (stream[9] << 8) | (stream[10] << 16) | ((uint32)stream[11] << 24), (uint32)stream.size());
+	return 0;
+}
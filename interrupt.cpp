@@ -1,99 +1,181 @@
+#include <atomic>
+
+/* Commands travel from the main executable to the timer interrupt through a single producer /
+   single consumer ring, and the answers to queries come back through a second one. Each side only
+   ever writes its own index, so neither needs a lock. */
+
+#define COMMAND_RING_SIZE		64		// power of 2
+
+struct Command {
+	uint8 command;
+	uint16 parameter;
+};
+
+struct CommandRing {
+	Command slots[COMMAND_RING_SIZE];
+	std::atomic<uint32> head;	// next slot to write, owned by the producer
+	std::atomic<uint32> tail;	// next slot to read, owned by the consumer
+};
+
+static bool ring_push(CommandRing *ring, uint8 command, uint16 parameter) {
+	uint32 head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) == COMMAND_RING_SIZE) {
+		return false;	// full
+	}
+	Command *slot = &ring->slots[head & (COMMAND_RING_SIZE - 1)];
+	slot->command = command;
+	slot->parameter = parameter;
+	ring->head.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+static bool ring_pop(CommandRing *ring, Command *out) {
+	uint32 tail = ring->tail.load(std::memory_order_relaxed);
+	if (tail == ring->head.load(std::memory_order_acquire)) {
+		return false;	// empty
+	}
+	*out = ring->slots[tail & (COMMAND_RING_SIZE - 1)];
+	ring->tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
 // these are shared with the main executable
-uint8 command;
-uint16 parameter;
+CommandRing commands;
+CommandRing replies;
+std::atomic<uint32> replies_dropped;	// answers lost because the replies ring was full
 
-// int 8 (timer)
-void interrupt_handler() {
+// main executable side. Returns false if the ring is full.
+bool post_command(uint8 command, uint16 parameter) {
+	return ring_push(&commands, command, parameter);
+}
+
+// main executable side. Answers to queries, in the order they were posted; replies_dropped counts
+// those there was no room for.
+bool poll_reply(uint8 *command, uint16 *parameter) {
+	Command reply;
+	if (!ring_pop(&replies, &reply)) {
+		return false;
+	}
+	*command = reply.command;
+	*parameter = reply.parameter;
+	return true;
+}
+
+// the song played by the timer interrupt
+AdlibDriver *adlib;
+
+// main executable side. The state published by the last tick, without a round trip through the rings.
+void read_status(DriverSnapshot *snapshot) {
+	adlib->midi_read_snapshot(snapshot);
+}
+
+/* runs one command. Queries return true and leave their answer in parameter. */
+static bool execute_command(uint8 command, uint16 &parameter) {
 	switch (command) {
 	case 1:
-		midi_stop();
+		adlib->midi_stop();
 		midi_buffer_hi = parameter;
 		break;
 	case 2:
-		midi_stop();
+		adlib->midi_stop();
 		midi_buffer_lo = parameter;
 		break;
 	case 3:
-		midi_buffer_size = parameter;
+		adlib->midi_buffer_size = parameter;
 		break;
 	case 4:
-		midi_resume();
+		adlib->midi_resume();
 		break;
 	case 5:
-		midi_fadeout_and_stop();
+		adlib->midi_fadeout_and_stop();
 		break;
 	case 6:
-		midi_pause();
-		eak;
+		adlib->midi_pause();
+		break;
 	case 7:
 		voices[parameter & 0xFF].volume = parameter >> 8;
 		break;
 	case 8:
-		midi_fade_in_flag = parameter != 0;
+		adlib->midi_fade_in_flag = parameter != 0;
 		break;
 	case 9:
-		midi_fade_out_flag = parameter != 0;
+		adlib->midi_fade_out_flag = parameter != 0;
 		break;
 	case 10:
-		midi_volume = parameter;
+		adlib->midi_volume = parameter;
 		break;
 	case 11:
-		reset_hw_timer();
-		ADLIB_mute_voices();
+		adlib->midi_stop();	// mutes the voices and restores the timer through the backend
 		set_interrupt_handler(8, old_interrupt_handler);
 		break;
 	case 12:
-		parameter = driver_status;
-		break;
+		parameter = adlib->driver_status;
+		return true;
 	case 13:
-		midi_fade_volume_change_rate = parameter & 0xFF;
-		fadeout_volume_cur = 0;
-		fadein_volume_cur = 0;
+		adlib->midi_set_fade_rate(parameter & 0xFF);
 		break;
 	case 14:
-		parameter = midi_volume;
-		break;
+		parameter = adlib->midi_volume;
+		return true;
 	case 15:
-		parameter = midi_fade_in_flag;
-		break;
+		parameter = adlib->midi_fade_in_flag;
+		return true;
 	case 16:
-		parameter = midi_fade_out_flag;
-		break;
+		parameter = adlib->midi_fade_out_flag;
+		return true;
 	case 17:
-		midi_tempo = parameter & 0xFF;
-		midi_set_tempo();
+		adlib->midi_tempo = parameter & 0xFF;
+		adlib->midi_set_tempo();
 		break;
 	case 18:
-		parameter = midi_tempo;
-		break;
+		parameter = adlib->midi_tempo;
+		return true;
 	case 19:
-		parameter = midi_fade_volume_change_rate;
-		break;
+		parameter = adlib->midi_fade_volume_change_rate;
+		return true;
 	case 20:
-		midi_loop = parameter != 0;
+		adlib->midi_loop = parameter != 0;
 		break;
 	case 21:
-		parameter = midi_loop;
-		break;
+		parameter = adlib->midi_loop;
+		return true;
 	case 22:
 		parameter = 0xF0;	// version??
-		break;
+		return true;
 	case 23:
 		parameter = 1;		// version??
-		break;
+		return true;
 	case 24:
 		voices[parameter & 0xFF].program = parameter >> 8;
 		break;
 	case 25:
-		parameter = voices[parameter & 0xFF].program;
+		parameter = (parameter & 0xFF) | (voices[parameter & 0xFF].program << 8);	// as posted to 24
+		return true;
+	case 26:
+		adlib->midi_reset_stats();	// the counters themselves are read with read_status()
 		break;
+	case 27:
+		adlib->stats_timing = parameter != 0;
+		break;
+	}
+	return false;
+}
+
+// int 8 (timer)
+void interrupt_handler() {
+	// run everything posted since the last tick, in order
+	Command cmd;
+	while (ring_pop(&commands, &cmd)) {
+		if (execute_command(cmd.command, cmd.parameter) && !ring_push(&replies, cmd.command, cmd.parameter)) {
+			// the main executable does not poll, it can tell from the count
+			replies_dropped.fetch_add(1, std::memory_order_relaxed);
+		}
 	}
-	
-	command = 0;
-	midi_driver();
+
+	adlib->midi_driver();
 	interrupt_cycles++;
 	if (interrupt_cycles >= interrupt_ratio) {
 		old_interrupt_handler();
 		interrupt_cycles = 0;
 	}
-}
\ No newline at end of file
+}
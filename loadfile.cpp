@@ -0,0 +1,17 @@
+#include <stdio.h>
+
+#include "loadfile.h"
+
+bool load_file(const char *path, std::vector<uint8> &data) {
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data.resize(size > 0 ? size : 0);
+	bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+	fclose(f);
+	return ok;
+}
@@ -0,0 +1,11 @@
+#ifndef LOADFILE_H
+#define LOADFILE_H
+
+#include <vector>
+
+#include "adlib.h"
+
+// the whole file in data. False if it cannot be read or is empty.
+bool load_file(const char *path, std::vector<uint8> &data);
+
+#endif
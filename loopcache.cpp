@@ -0,0 +1,126 @@
+#include <memory.h>
+
+#include "loopcache.h"
+
+LoopCache::LoopCache(OplEmulator *opl, AdlibDriver *driver, bool stereo) :
+	cached(false),
+	loop_samples(0),
+	opl(opl),
+	driver(driver),
+	channels(stereo ? 2 : 1),
+	max_samples(opl->rate * LOOP_CACHE_MAX_SECONDS),
+	loops(0),
+	loop_pending(false),
+	loop_sample(0),
+	recording(false),
+	attempts(0),
+	cache_pos(0) {
+	chip_state = OPL_create(opl->rate);
+}
+
+LoopCache::~LoopCache() {
+	OPL_destroy(chip_state);
+}
+
+void LoopCache::start() {
+	cached = false;
+	loop_samples = 0;
+	loops = driver->midi_loops;
+	loop_pending = false;
+	loop_sample = 0;
+	recording = false;
+	attempts = 0;
+	cache.clear();
+	cache_pos = 0;
+}
+
+/* runs the driver until samples frames are known, up to the next loop point */
+void LoopCache::run(uint32 samples) {
+	while (!loop_pending && driver->driver_status == kStatusPlaying && opl->ready() < samples) {
+		uint32 ticks = driver->midi_advance(driver->midi_idle_ticks());
+		if (ticks == 0) {
+			driver->midi_driver();
+			ticks = 1;
+		}
+		if (driver->midi_loops != loops) {
+			// the writes of this tick start the next loop
+			loops = driver->midi_loops;
+			loop_pending = true;
+			loop_sample = opl->tick_sample;
+		}
+		opl->next_ticks(ticks);
+	}
+}
+
+/* the output is at the start of a loop: the recording either ends with the driver and the chip back
+   in the state it started in, or starts over from here */
+void LoopCache::loop_point() {
+	loop_pending = false;
+	opl->render(0, 0, channels == 2);	// the writes of the first tick
+
+	if (recording && !cache.empty() && driver->midi_in_state(&driver_state) && OPL_same_state(opl->chip, chip_state)) {
+		recording = false;
+		cached = true;
+		loop_samples = cache.size() / channels;
+		cache_pos = 0;
+		return;
+	}
+
+	if (attempts == LOOP_CACHE_ATTEMPTS) {
+		recording = false;
+		std::vector<int16>().swap(cache);
+		return;
+	}
+	attempts++;
+	driver->midi_save_state(&driver_state);
+	OPL_copy(chip_state, opl->chip);
+	cache.clear();
+	recording = true;
+}
+
+void LoopCache::render(int16 *buffer, uint32 samples) {
+	while (samples > 0) {
+		uint32 n = samples;
+
+		if (cached) {
+			if (n > loop_samples - cache_pos) {
+				n = loop_samples - cache_pos;
+			}
+			memcpy(buffer, &cache[cache_pos * channels], n * channels * sizeof(int16));
+			cache_pos += n;
+			if (cache_pos == loop_samples) {
+				cache_pos = 0;
+			}
+		} else {
+			if (loop_pending && opl->rendered == loop_sample) {
+				loop_point();
+				continue;
+			}
+
+			run(samples);
+			if (loop_pending) {
+				n = loop_sample - opl->rendered;	// stop at the loop point
+			} else if (driver->driver_status == kStatusPlaying) {
+				n = opl->ready();
+			}
+			if (n > samples) {
+				n = samples;
+			}
+			opl->render(buffer, n, channels == 2);
+
+			if (recording) {
+				if (cache.size() / channels + n > max_samples) {
+					// too long to keep
+					recording = false;
+					attempts = LOOP_CACHE_ATTEMPTS;
+					std::vector<int16>().swap(cache);
+				} else {
+					cache.insert(cache.end(), buffer, buffer + n * channels);
+				}
+			}
+		}
+
+		buffer += n * channels;
+		samples -= n;
+	}
+}
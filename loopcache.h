@@ -0,0 +1,60 @@
+#ifndef LOOPCACHE_H
+#define LOOPCACHE_H
+
+#include <vector>
+
+#include "adlib.h"
+#include "opl.h"
+
+/**********************************
+	PCM loop cache
+
+	A looping song (midi_loop) plays the same events over and over. Once the
+	driver and the chip are back where they were at the start of a loop, every
+	loop after is a copy of the one before. The cache records one loop as it
+	is synthesised, compares the driver and the chip at its end with their
+	state at its start, and if they match plays every later loop from the
+	recording: the driver and the chip stop running. If they do not match the
+	next loop is recorded instead, until LOOP_CACHE_ATTEMPTS have failed.
+
+	The LFOs and the noise generator of the chip run freely and are not
+	compared. A cached loop is also a whole number of samples long, so a
+	fractional tick length can make the playback off by up to one sample
+	per loop.
+*/
+
+#define LOOP_CACHE_MAX_SECONDS	120		// longer loops play live
+#define LOOP_CACHE_ATTEMPTS		4
+
+class LoopCache {
+public:
+	LoopCache(OplEmulator *opl, AdlibDriver *driver, bool stereo);
+	~LoopCache();
+
+	void start();		// after midi_resume() of a song with midi_loop set
+	void render(int16 *buffer, uint32 samples);	// interleaved if stereo
+
+	bool cached;			// the song plays from the recording
+	uint32 loop_samples;	// length of the recorded loop
+
+private:
+	void run(uint32 samples);
+	void loop_point();
+
+	OplEmulator *opl;
+	AdlibDriver *driver;
+	uint32 channels;
+	uint32 max_samples;
+
+	uint32 loops;			// driver->midi_loops seen so far
+	bool loop_pending;		// the driver started over, the output has not reached it yet
+	uint64 loop_sample;		// where
+	bool recording;
+	int attempts;
+	DriverCheckpoint driver_state;	// at the start of the recorded loop
+	OPL_Chip *chip_state;
+	std::vector<int16> cache;
+	uint32 cache_pos;		// next frame to play
+};
+
+#endif
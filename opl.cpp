@@ -0,0 +1,874 @@
+#include <math.h>
+#include <memory.h>
+
+#include "opl.h"
+
+#if defined(__AVX2__) && !defined(OPL_NO_SIMD)
+#include <immintrin.h>
+#define OPL_SIMD_AVX2
+#elif defined(__SSE2__) && !defined(OPL_NO_SIMD)
+#include <emmintrin.h>
+#define OPL_SIMD_SSE2
+#endif
+
+#define OPL_CHANNELS		18		// 9 per register bank
+#define OPL_LANES			24		// operator lanes per group, padded to a multiple of the vector width
+#define OPL_SLOTS			(2 * OPL_LANES)	// lanes [0..24) are modulators, [24..48) carriers
+#define OPL2_LANES			16		// lanes stepped while the second bank is off
+
+#define OPL_SLOT(channel,op)	((op) * OPL_LANES + (channel))
+
+#define MAX_ATTENUATION		511		// envelope range, in 0.1875 dB steps
+#define SILENT_LEVEL		0x1000	// log attenuation that shifts the output to 0
+
+enum EnvelopeState {
+	kEnvAttack,
+	kEnvDecay,
+	kEnvSustain,
+	kEnvRelease,
+	kEnvOff
+};
+
+// key on sources of an operator
+#define KEY_NORMAL			1		// 0xB0-0xB8 bit 5
+#define KEY_RHYTHM			2		// 0xBD bits 0-4
+
+struct OPL_Chip {
+	// per operator state, one lane each
+	uint32 phase[OPL_SLOTS];
+	uint32 phase_inc[OPL_SLOTS];	// including vibrato
+	float  env[OPL_SLOTS];			// current attenuation, 0..MAX_ATTENUATION
+	int32  env_state[OPL_SLOTS];
+	float  attack_mul[OPL_SLOTS];
+	float  decay_inc[OPL_SLOTS];
+	float  release_inc[OPL_SLOTS];
+	float  sustain_level[OPL_SLOTS];
+	int32  sustain_hold[OPL_SLOTS];	// -1 if the envelope holds at the sustain level, 0 if it goes on decaying
+	int32  base_level[OPL_SLOTS];	// total level and key scaling, in 0.1875 dB steps
+	int32  am_mask[OPL_SLOTS];		// -1 if tremolo is enabled
+	int32  wave_offset[OPL_SLOTS];	// waveform * 1024
+	int32  out[OPL_SLOTS];
+	int32  prev_out[OPL_SLOTS];		// previous output, for feedback
+	int32  mod[OPL_SLOTS];			// phase modulation input
+
+	uint32 base_inc[OPL_SLOTS];
+	uint8  vibrato[OPL_SLOTS];
+	uint8  key[OPL_SLOTS];
+
+	// per channel state
+	uint8 feedback[OPL_CHANNELS];
+	uint8 additive[OPL_CHANNELS];
+	uint8 pan[OPL_CHANNELS];		// 1 left, 2 right
+
+	uint8 regs[512];
+	int   lanes;		// lanes in use in each group
+	bool  opl3;			// 0x105 bit 0: second bank, pan and 8 waveforms
+	bool  wave_enable;
+	bool  rhythm;
+	bool  am_deep;
+	bool  vibrato_deep;
+
+	// low frequency oscillators and noise
+	uint32 am_phase, am_inc;
+	uint32 vib_phase, vib_inc;
+	int32  vib_value;
+	uint32 noise;
+
+	uint32 rate;
+	float  step_scale;	// native samples per output sample
+	uint32 freq_scale;	// the same, in 16.16 fixed point
+};
+
+
+/**********************************
+	tables
+*/
+
+struct OPL_Tables {
+	int32 wave[8 * 1024];	// log-sine attenuation per waveform, bit 15 is the sign
+	int32 exp[256];
+
+	OPL_Tables() {
+		int32 logsin[256];
+		for (int i = 0; i < 256; ++i) {
+			logsin[i] = (int32)round(-log(sin((i + 0.5) * M_PI / 512.0)) / log(2.0) * 256.0);
+			exp[i] = (int32)round(4096.0 * pow(2.0, -i / 256.0));
+		}
+		exp[0] = 4095;
+
+		for (int i = 0; i < 1024; ++i) {
+			int32 quarter = (i & 256) ? logsin[255 - (i & 255)] : logsin[i & 255];
+			int32 negative = (i & 512) ? 0x8000 : 0;
+
+			wave[i] = quarter | negative;									// sine
+			wave[1024 + i] = negative ? SILENT_LEVEL : quarter;				// half sine
+			wave[2048 + i] = quarter;										// absolute sine
+			wave[3072 + i] = (i & 256) ? SILENT_LEVEL : logsin[i & 255];	// quarter sine pulses
+
+			// OPL3 only
+			int32 twice = (i & 512) ? SILENT_LEVEL : wave[(2 * i) & 1023];
+			wave[4096 + i] = twice;														// alternating sine
+			wave[5120 + i] = (twice == SILENT_LEVEL) ? twice : (twice & 0x7FFF);		// alternating absolute sine
+			wave[6144 + i] = negative;													// square
+			wave[7168 + i] = negative | (((i & 512) ? 511 - (i & 511) : i) << 3);		// logarithmic sawtooth
+		}
+	}
+};
+
+static const OPL_Tables &OPL_tables() {
+	static const OPL_Tables tables;
+	return tables;
+}
+
+// frequency multiplier, times 2
+static const uint8 mult_table[16] = {
+	1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 20, 24, 24, 30, 30
+};
+
+// key scaling attenuation at block 7, in 0.75 dB steps
+static const uint8 ksl_table[16] = {
+	0, 32, 40, 45, 48, 51, 53, 55, 56, 58, 59, 60, 61, 62, 63, 64
+};
+
+// shift applied to the key scaling attenuation: off, 3 dB, 1.5 dB and 6 dB per octave
+static const uint8 ksl_shift[4] = {
+	31, 1, 2, 0
+};
+
+// per bank
+static const uint8 operator_offsets[9] = {
+	 0x0,  0x1,  0x2,  0x8,  0x9,  0xa, 0x10, 0x11, 0x12
+};
+
+static const int8 vibrato_table[8] = {
+	0, 1, 2, 1, 0, -1, -2, -1
+};
+
+
+/**********************************
+	kernels
+*/
+
+/* envelopes of the operators in lanes [first, first + chip->lanes) */
+static void OPL_envelope_kernel(OPL_Chip *chip, int first) {
+#if defined(OPL_SIMD_AVX2)
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 max = _mm256_set1_ps((float)MAX_ATTENUATION);
+	const __m256i inc = _mm256_set1_epi32(1);
+	const __m256i decay_to_release = _mm256_set1_epi32(2);
+
+	for (int i = first; i < first + chip->lanes; i += 8) {
+		__m256i state = _mm256_loadu_si256((const __m256i *)&chip->env_state[i]);
+		__m256 env = _mm256_loadu_ps(&chip->env[i]);
+		__m256 is_attack = _mm256_castsi256_ps(_mm256_cmpeq_epi32(state, _mm256_set1_epi32(kEnvAttack)));
+		__m256 is_decay = _mm256_castsi256_ps(_mm256_cmpeq_epi32(state, _mm256_set1_epi32(kEnvDecay)));
+		__m256 is_release = _mm256_castsi256_ps(_mm256_cmpeq_epi32(state, _mm256_set1_epi32(kEnvRelease)));
+
+		__m256 attack = _mm256_mul_ps(env, _mm256_loadu_ps(&chip->attack_mul[i]));
+		__m256 attack_done = _mm256_cmp_ps(attack, one, _CMP_LT_OQ);
+		attack = _mm256_blendv_ps(attack, zero, attack_done);
+
+		__m256 sustain = _mm256_loadu_ps(&chip->sustain_level[i]);
+		__m256 decay = _mm256_add_ps(env, _mm256_loadu_ps(&chip->decay_inc[i]));
+		__m256 decay_done = _mm256_cmp_ps(decay, sustain, _CMP_GE_OQ);
+		decay = _mm256_blendv_ps(decay, sustain, decay_done);
+
+		__m256 release = _mm256_min_ps(_mm256_add_ps(env, _mm256_loadu_ps(&chip->release_inc[i])), max);
+		__m256 release_done = _mm256_cmp_ps(release, max, _CMP_GE_OQ);
+
+		env = _mm256_blendv_ps(env, release, is_release);
+		env = _mm256_blendv_ps(env, decay, is_decay);
+		env = _mm256_blendv_ps(env, attack, is_attack);
+
+		// attack -> decay -> sustain (or release) -> off
+		__m256i hold = _mm256_loadu_si256((const __m256i *)&chip->sustain_hold[i]);
+		__m256i step = _mm256_and_si256(_mm256_castps_si256(_mm256_and_ps(is_attack, attack_done)), inc);
+		step = _mm256_add_epi32(step, _mm256_and_si256(_mm256_castps_si256(_mm256_and_ps(is_decay, decay_done)), _mm256_add_epi32(decay_to_release, hold)));
+		step = _mm256_add_epi32(step, _mm256_and_si256(_mm256_castps_si256(_mm256_and_ps(is_release, release_done)), inc));
+
+		_mm256_storeu_si256((__m256i *)&chip->env_state[i], _mm256_add_epi32(state, step));
+		_mm256_storeu_ps(&chip->env[i], env);
+	}
+#elif defined(OPL_SIMD_SSE2)
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 max = _mm_set1_ps((float)MAX_ATTENUATION);
+	const __m128i inc = _mm_set1_epi32(1);
+	const __m128i decay_to_release = _mm_set1_epi32(2);
+
+	#define BLEND(a,b,mask)	_mm_or_ps(_mm_and_ps((mask), (b)), _mm_andnot_ps((mask), (a)))
+
+	for (int i = first; i < first + chip->lanes; i += 4) {
+		__m128i state = _mm_loadu_si128((const __m128i *)&chip->env_state[i]);
+		__m128 env = _mm_loadu_ps(&chip->env[i]);
+		__m128 is_attack = _mm_castsi128_ps(_mm_cmpeq_epi32(state, _mm_set1_epi32(kEnvAttack)));
+		__m128 is_decay = _mm_castsi128_ps(_mm_cmpeq_epi32(state, _mm_set1_epi32(kEnvDecay)));
+		__m128 is_release = _mm_castsi128_ps(_mm_cmpeq_epi32(state, _mm_set1_epi32(kEnvRelease)));
+
+		__m128 attack = _mm_mul_ps(env, _mm_loadu_ps(&chip->attack_mul[i]));
+		__m128 attack_done = _mm_cmplt_ps(attack, one);
+		attack = _mm_andnot_ps(attack_done, attack);
+
+		__m128 sustain = _mm_loadu_ps(&chip->sustain_level[i]);
+		__m128 decay = _mm_add_ps(env, _mm_loadu_ps(&chip->decay_inc[i]));
+		__m128 decay_done = _mm_cmpge_ps(decay, sustain);
+		decay = BLEND(decay, sustain, decay_done);
+
+		__m128 release = _mm_min_ps(_mm_add_ps(env, _mm_loadu_ps(&chip->release_inc[i])), max);
+		__m128 release_done = _mm_cmpge_ps(release, max);
+
+		env = BLEND(env, release, is_release);
+		env = BLEND(env, decay, is_decay);
+		env = BLEND(env, attack, is_attack);
+
+		// attack -> decay -> sustain (or release) -> off
+		__m128i hold = _mm_loadu_si128((const __m128i *)&chip->sustain_hold[i]);
+		__m128i step = _mm_and_si128(_mm_castps_si128(_mm_and_ps(is_attack, attack_done)), inc);
+		step = _mm_add_epi32(step, _mm_and_si128(_mm_castps_si128(_mm_and_ps(is_decay, decay_done)), _mm_add_epi32(decay_to_release, hold)));
+		step = _mm_add_epi32(step, _mm_and_si128(_mm_castps_si128(_mm_and_ps(is_release, release_done)), inc));
+
+		_mm_storeu_si128((__m128i *)&chip->env_state[i], _mm_add_epi32(state, step));
+		_mm_storeu_ps(&chip->env[i], env);
+	}
+
+	#undef BLEND
+#else
+	for (int i = first; i < first + chip->lanes; ++i) {
+		float env = chip->env[i];
+
+		switch (chip->env_state[i]) {
+		case kEnvAttack:
+			env *= chip->attack_mul[i];
+			if (env < 1.0f) {
+				env = 0.0f;
+				chip->env_state[i] = kEnvDecay;
+			}
+			break;
+
+		case kEnvDecay:
+			env += chip->decay_inc[i];
+			if (env >= chip->sustain_level[i]) {
+				env = chip->sustain_level[i];
+				chip->env_state[i] = chip->sustain_hold[i] ? kEnvSustain : kEnvRelease;
+			}
+			break;
+
+		case kEnvRelease:
+			env += chip->release_inc[i];
+			if (env >= MAX_ATTENUATION) {
+				env = MAX_ATTENUATION;
+				chip->env_state[i] = kEnvOff;
+			}
+			break;
+		}
+
+		chip->env[i] = env;
+	}
+#endif
+}
+
+static void OPL_phase_kernel(OPL_Chip *chip, int first) {
+#if defined(OPL_SIMD_AVX2)
+	for (int i = first; i < first + chip->lanes; i += 8) {
+		__m256i phase = _mm256_loadu_si256((const __m256i *)&chip->phase[i]);
+		phase = _mm256_add_epi32(phase, _mm256_loadu_si256((const __m256i *)&chip->phase_inc[i]));
+		_mm256_storeu_si256((__m256i *)&chip->phase[i], phase);
+	}
+#elif defined(OPL_SIMD_SSE2)
+	for (int i = first; i < first + chip->lanes; i += 4) {
+		__m128i phase = _mm_loadu_si128((const __m128i *)&chip->phase[i]);
+		phase = _mm_add_epi32(phase, _mm_loadu_si128((const __m128i *)&chip->phase_inc[i]));
+		_mm_storeu_si128((__m128i *)&chip->phase[i], phase);
+	}
+#else
+	for (int i = first; i < first + chip->lanes; ++i) {
+		chip->phase[i] += chip->phase_inc[i];
+	}
+#endif
+}
+
+static inline int32 OPL_lookup(const OPL_Tables &tables, int32 index, int32 level) {
+	int32 wave = tables.wave[index];
+	level += wave & 0x7FFF;
+	int32 out = (level < SILENT_LEVEL) ? (tables.exp[level & 0xFF] >> (level >> 8)) : 0;
+	return (wave & 0x8000) ? -out : out;
+}
+
+/* output of the operators in lanes [first, first + chip->lanes), phase modulated by chip->mod */
+static void OPL_operator_kernel(OPL_Chip *chip, int first, int32 am) {
+	const OPL_Tables &tables = OPL_tables();
+
+#if defined(OPL_SIMD_AVX2)
+	const __m256i am_value = _mm256_set1_epi32(am);
+	const __m256i index_mask = _mm256_set1_epi32(1023);
+
+	for (int i = first; i < first + chip->lanes; i += 8) {
+		__m256i phase = _mm256_loadu_si256((const __m256i *)&chip->phase[i]);
+		__m256i index = _mm256_add_epi32(_mm256_srli_epi32(phase, 22), _mm256_loadu_si256((const __m256i *)&chip->mod[i]));
+		index = _mm256_add_epi32(_mm256_and_si256(index, index_mask), _mm256_loadu_si256((const __m256i *)&chip->wave_offset[i]));
+
+		__m256i level = _mm256_cvttps_epi32(_mm256_loadu_ps(&chip->env[i]));
+		level = _mm256_add_epi32(level, _mm256_loadu_si256((const __m256i *)&chip->base_level[i]));
+		level = _mm256_add_epi32(level, _mm256_and_si256(am_value, _mm256_loadu_si256((const __m256i *)&chip->am_mask[i])));
+		level = _mm256_min_epi32(level, _mm256_set1_epi32(MAX_ATTENUATION));
+
+		__m256i wave = _mm256_i32gather_epi32(tables.wave, index, 4);
+		__m256i negative = _mm256_cmpeq_epi32(_mm256_and_si256(wave, _mm256_set1_epi32(0x8000)), _mm256_set1_epi32(0x8000));
+		level = _mm256_add_epi32(_mm256_and_si256(wave, _mm256_set1_epi32(0x7FFF)), _mm256_slli_epi32(level, 3));
+
+		__m256i out = _mm256_i32gather_epi32(tables.exp, _mm256_and_si256(level, _mm256_set1_epi32(0xFF)), 4);
+		out = _mm256_srlv_epi32(out, _mm256_srli_epi32(level, 8));
+		out = _mm256_sub_epi32(_mm256_xor_si256(out, negative), negative);
+
+		_mm256_storeu_si256((__m256i *)&chip->out[i], out);
+	}
+#elif defined(OPL_SIMD_SSE2)
+	// SSE2 has no gathers: compute indices and levels four lanes at a time, then look them up
+	const __m128i am_value = _mm_set1_epi32(am);
+	const __m128i index_mask = _mm_set1_epi32(1023);
+	int32 index[OPL_LANES];
+	int32 level[OPL_LANES];
+
+	for (int i = 0; i < chip->lanes; i += 4) {
+		int lane = first + i;
+		__m128i phase = _mm_loadu_si128((const __m128i *)&chip->phase[lane]);
+		__m128i idx = _mm_add_epi32(_mm_srli_epi32(phase, 22), _mm_loadu_si128((const __m128i *)&chip->mod[lane]));
+		idx = _mm_add_epi32(_mm_and_si128(idx, index_mask), _mm_loadu_si128((const __m128i *)&chip->wave_offset[lane]));
+
+		__m128i lvl = _mm_cvttps_epi32(_mm_loadu_ps(&chip->env[lane]));
+		lvl = _mm_add_epi32(lvl, _mm_loadu_si128((const __m128i *)&chip->base_level[lane]));
+		lvl = _mm_add_epi32(lvl, _mm_and_si128(am_value, _mm_loadu_si128((const __m128i *)&chip->am_mask[lane])));
+
+		_mm_storeu_si128((__m128i *)&index[i], idx);
+		_mm_storeu_si128((__m128i *)&level[i], _mm_slli_epi32(lvl, 3));
+	}
+
+	for (int i = 0; i < chip->lanes; ++i) {
+		chip->out[first + i] = OPL_lookup(tables, index[i], level[i]);
+	}
+#else
+	for (int i = first; i < first + chip->lanes; ++i) {
+		int32 index = (((chip->phase[i] >> 22) + chip->mod[i]) & 1023) + chip->wave_offset[i];
+		int32 level = (int32)chip->env[i] + chip->base_level[i] + (am & chip->am_mask[i]);
+		chip->out[i] = OPL_lookup(tables, index, level << 3);
+	}
+#endif
+}
+
+
+/**********************************
+	register handling
+*/
+
+static uint32 OPL_vibrato_inc(OPL_Chip *chip, int slot) {
+	if (!chip->vibrato[slot] || chip->vib_value == 0) {
+		return chip->base_inc[slot];
+	}
+	// 7 cents per step (3.5 if shallow)
+	int32 depth = chip->vibrato_deep ? 266 : 133;
+	int64 delta = ((int64)chip->base_inc[slot] * chip->vib_value * depth) >> 16;
+	return (uint32)((int64)chip->base_inc[slot] + delta);
+}
+
+static float OPL_envelope_step(OPL_Chip *chip, uint8 rate, uint8 key_scale) {
+	if (rate == 0) {
+		return 0.0f;
+	}
+	int r = 4 * rate + key_scale;
+	if (r > 63) {
+		r = 63;
+	}
+	// 0.1875 dB steps per native sample: 96 dB take 2.4 ms at rate 15, doubling for each rate below
+	return (float)((4 + (r & 3)) << (r >> 2)) / 32768.0f * chip->step_scale;
+}
+
+static void OPL_update_slot(OPL_Chip *chip, int channel, int op) {
+	int slot = OPL_SLOT(channel, op);
+	const uint8 *regs = &chip->regs[channel < 9 ? 0 : 0x100];
+	uint8 offset = operator_offsets[channel % 9] + 3 * op;
+
+	uint8 r20 = regs[0x20 + offset];
+	uint8 r40 = regs[0x40 + offset];
+	uint8 r60 = regs[0x60 + offset];
+	uint8 r80 = regs[0x80 + offset];
+	uint8 rE0 = regs[0xE0 + offset];
+
+	uint16 fnumber = regs[0xA0 + channel % 9] | ((regs[0xB0 + channel % 9] & 3) << 8);
+	uint8 block = (regs[0xB0 + channel % 9] >> 2) & 7;
+
+	// phase increment on a 32-bit phase, 10 bits of which index the waveform
+	chip->base_inc[slot] = (uint32)(((uint64)(fnumber << block) * mult_table[r20 & 0xF] * chip->freq_scale) >> 5);
+	chip->vibrato[slot] = (r20 & 0x40) != 0;
+	chip->phase_inc[slot] = OPL_vibrato_inc(chip, slot);
+
+	chip->am_mask[slot] = (r20 & 0x80) ? -1 : 0;
+	if (chip->opl3) {
+		chip->wave_offset[slot] = (rE0 & 7) * 1024;
+	} else {
+		chip->wave_offset[slot] = chip->wave_enable ? (rE0 & 3) * 1024 : 0;
+	}
+
+	// total level (0.75 dB steps) and key scaling (6 dB per octave below block 7 at full setting)
+	int32 ksl = ksl_table[fnumber >> 6] * 4 - (7 - block) * 32;
+	if (ksl < 0) {
+		ksl = 0;
+	}
+	chip->base_level[slot] = (r40 & 0x3F) * 4 + (ksl >> ksl_shift[r40 >> 6]);
+
+	// envelope
+	uint8 key_code = (block << 1) | ((fnumber >> 9) & 1);
+	uint8 key_scale = (r20 & 0x10) ? key_code : (key_code >> 2);
+
+	uint8 attack = r60 >> 4;
+	float attack_step = OPL_envelope_step(chip, attack, key_scale);
+	if (attack == 0) {
+		chip->attack_mul[slot] = 1.0f;
+	} else if (4 * attack + key_scale >= 60) {
+		chip->attack_mul[slot] = 0.0f;
+	} else {
+		// the attack is exponential and about 14 times faster than a decay at the same rate
+		float samples = MAX_ATTENUATION / (attack_step * 14.0f);
+		chip->attack_mul[slot] = (float)exp(log(1.0 / MAX_ATTENUATION) / samples);
+	}
+	chip->decay_inc[slot] = OPL_envelope_step(chip, r60 & 0xF, key_scale);
+	chip->release_inc[slot] = OPL_envelope_step(chip, r80 & 0xF, key_scale);
+
+	uint8 sustain = r80 >> 4;
+	chip->sustain_level[slot] = (float)((sustain == 15 ? 31 : sustain) << 4);
+	chip->sustain_hold[slot] = (r20 & 0x20) ? -1 : 0;
+}
+
+static void OPL_set_key(OPL_Chip *chip, int slot, uint8 source, bool on) {
+	uint8 old_key = chip->key[slot];
+	chip->key[slot] = on ? (old_key | source) : (old_key & ~source);
+
+	if (!old_key && chip->key[slot]) {
+		chip->phase[slot] = 0;
+		if (chip->attack_mul[slot] == 0.0f) {
+			chip->env[slot] = 0.0f;
+			chip->env_state[slot] = kEnvDecay;
+		} else {
+			chip->env_state[slot] = kEnvAttack;
+		}
+	} else if (old_key && !chip->key[slot]) {
+		if (chip->env_state[slot] != kEnvOff) {
+			chip->env_state[slot] = kEnvRelease;
+		}
+	}
+}
+
+static void OPL_write_rhythm(OPL_Chip *chip, uint8 value) {
+	chip->am_deep = (value & 0x80) != 0;
+	chip->vibrato_deep = (value & 0x40) != 0;
+	chip->rhythm = (value & 0x20) != 0;
+
+	bool bd = chip->rhythm && (value & 0x10);
+	bool sd = chip->rhythm && (value & 0x08);
+	bool tt = chip->rhythm && (value & 0x04);
+	bool cy = chip->rhythm && (value & 0x02);
+	bool hh = chip->rhythm && (value & 0x01);
+
+	OPL_set_key(chip, OPL_SLOT(6, 0), KEY_RHYTHM, bd);
+	OPL_set_key(chip, OPL_SLOT(6, 1), KEY_RHYTHM, bd);
+	OPL_set_key(chip, OPL_SLOT(7, 0), KEY_RHYTHM, hh);
+	OPL_set_key(chip, OPL_SLOT(7, 1), KEY_RHYTHM, sd);
+	OPL_set_key(chip, OPL_SLOT(8, 0), KEY_RHYTHM, tt);
+	OPL_set_key(chip, OPL_SLOT(8, 1), KEY_RHYTHM, cy);
+}
+
+static void OPL_update_channel(OPL_Chip *chip, int channel) {
+	uint8 value = chip->regs[(channel < 9 ? 0xC0 : 0x1C0) + channel % 9];
+	chip->feedback[channel] = (value >> 1) & 7;
+	chip->additive[channel] = value & 1;
+	// OPL2 has no pan bits and plays everything on both sides
+	chip->pan[channel] = chip->opl3 ? (value >> 4) & 3 : 3;
+}
+
+/* reg 0x000-0x0FF is the first bank, 0x100-0x1FF the second one */
+void OPL_write(OPL_Chip *chip, uint16 reg, uint8 value) {
+	reg &= 0x1FF;
+	chip->regs[reg] = value;
+	int bank = (reg >> 8) * 9;
+
+	switch (reg & 0xF0) {
+	case 0x00:
+		if (reg == 0x01 || reg == 0x105) {
+			chip->wave_enable = (chip->regs[0x01] & 0x20) != 0;
+			chip->opl3 = (chip->regs[0x105] & 1) != 0;
+			chip->lanes = chip->opl3 ? OPL_LANES : OPL2_LANES;
+			for (int i = 0; i < OPL_CHANNELS; ++i) {
+				OPL_update_slot(chip, i, 0);
+				OPL_update_slot(chip, i, 1);
+				OPL_update_channel(chip, i);
+			}
+		}
+		break;
+
+	case 0x20: case 0x30:
+	case 0x40: case 0x50:
+	case 0x60: case 0x70:
+	case 0x80: case 0x90:
+	case 0xE0: case 0xF0: {
+		uint8 offset = reg & 0x1F;
+		if ((offset & 7) >= 6 || offset >= 0x16) {
+			break;
+		}
+		int channel = bank + (offset >> 3) * 3 + (offset & 7) % 3;
+		OPL_update_slot(chip, channel, (offset & 7) / 3);
+		break;
+	}
+
+	case 0xA0:
+	case 0xB0: {
+		if (reg == 0xBD) {
+			OPL_write_rhythm(chip, value);
+			break;
+		}
+		if ((reg & 0x0F) >= 9) {
+			break;
+		}
+		int channel = bank + (reg & 0x0F);
+		OPL_update_slot(chip, channel, 0);
+		OPL_update_slot(chip, channel, 1);
+		if (reg & 0x10) {
+			bool on = (value & 0x20) != 0;
+			OPL_set_key(chip, OPL_SLOT(channel, 0), KEY_NORMAL, on);
+			OPL_set_key(chip, OPL_SLOT(channel, 1), KEY_NORMAL, on);
+		}
+		break;
+	}
+
+	case 0xC0:
+		if ((reg & 0x0F) < 9) {
+			OPL_update_channel(chip, bank + (reg & 0x0F));
+		}
+		break;
+	}
+}
+
+
+/**********************************
+	synthesis
+*/
+
+static void OPL_step_lfo(OPL_Chip *chip, int32 *am) {
+	// tremolo: 3.7 Hz triangle, 4.8 dB deep (1.2 dB if shallow)
+	chip->am_phase += chip->am_inc;
+	uint32 triangle = (chip->am_phase & 0x80000000) ? ~chip->am_phase : chip->am_phase;
+	*am = (int32)(((uint64)(triangle >> 15) * 26) >> 16);
+	if (!chip->am_deep) {
+		*am >>= 2;
+	}
+
+	// vibrato: 6.1 Hz, in 8 steps
+	chip->vib_phase += chip->vib_inc;
+	int32 vib_value = vibrato_table[chip->vib_phase >> 29];
+	if (vib_value != chip->vib_value) {
+		chip->vib_value = vib_value;
+		for (int i = 0; i < OPL_SLOTS; ++i) {
+			if (chip->vibrato[i]) {
+				chip->phase_inc[i] = OPL_vibrato_inc(chip, i);
+			}
+		}
+	}
+
+	// 23-bit noise generator used by the rhythm section
+	uint32 bit = ((chip->noise >> 14) ^ chip->noise) & 1;
+	chip->noise = (chip->noise >> 1) | (bit << 22);
+}
+
+static int32 OPL_rhythm_output(OPL_Chip *chip, int slot, int32 index, int32 am) {
+	int32 level = (int32)chip->env[slot] + chip->base_level[slot] + (am & chip->am_mask[slot]);
+	if (level > MAX_ATTENUATION) {
+		level = MAX_ATTENUATION;
+	}
+	return OPL_lookup(OPL_tables(), (index & 1023) + chip->wave_offset[slot], level << 3);
+}
+
+static inline void OPL_mix(OPL_Chip *chip, int channel, int32 out, int32 *left, int32 *right) {
+	if (chip->pan[channel] & 1) {
+		*left += out;
+	}
+	if (chip->pan[channel] & 2) {
+		*right += out;
+	}
+}
+
+/* hi-hat, snare drum and cymbal replace the phase of their operators with bits taken from the
+   hi-hat and cymbal phases, mixed with noise */
+static void OPL_rhythm(OPL_Chip *chip, int32 am, int32 *left, int32 *right) {
+	uint32 hh_phase = chip->phase[OPL_SLOT(7, 0)] >> 22;
+	uint32 cy_phase = chip->phase[OPL_SLOT(8, 1)] >> 22;
+	uint32 noise = chip->noise & 1;
+
+	uint32 hh_bit2 = (hh_phase >> 2) & 1;
+	uint32 hh_bit3 = (hh_phase >> 3) & 1;
+	uint32 hh_bit7 = (hh_phase >> 7) & 1;
+	uint32 hh_bit8 = (hh_phase >> 8) & 1;
+	uint32 cy_bit3 = (cy_phase >> 3) & 1;
+	uint32 cy_bit5 = (cy_phase >> 5) & 1;
+	uint32 mix = (hh_bit2 ^ hh_bit7) | (hh_bit3 ^ cy_bit5) | (cy_bit3 ^ cy_bit5);
+
+	int32 hh_index = (mix << 9) | ((mix ^ noise) ? 0xD0 : 0x34);
+	int32 sd_index = (hh_bit8 << 9) | ((hh_bit8 ^ noise) << 8);
+	int32 cy_index = (mix << 9) | 0x80;
+
+	// each instrument goes where its channel is panned
+	int32 bd = chip->additive[6] ? chip->out[OPL_SLOT(6, 0)] + chip->out[OPL_SLOT(6, 1)] : chip->out[OPL_SLOT(6, 1)];
+	int32 hh_sd = OPL_rhythm_output(chip, OPL_SLOT(7, 0), hh_index, am) + OPL_rhythm_output(chip, OPL_SLOT(7, 1), sd_index, am);
+	int32 tt_cy = chip->out[OPL_SLOT(8, 0)] + OPL_rhythm_output(chip, OPL_SLOT(8, 1), cy_index, am);	// tom tom is a plain operator
+
+	OPL_mix(chip, 6, bd * 2, left, right);
+	OPL_mix(chip, 7, hh_sd * 2, left, right);
+	OPL_mix(chip, 8, tt_cy * 2, left, right);
+}
+
+static inline int16 OPL_clip(int32 sample) {
+	if (sample > 32767) {
+		return 32767;
+	} else if (sample < -32768) {
+		return -32768;
+	}
+	return (int16)sample;
+}
+
+/* one output sample of each side */
+static void OPL_sample(OPL_Chip *chip, int32 *left, int32 *right) {
+	int32 am;
+	OPL_step_lfo(chip, &am);
+
+	OPL_envelope_kernel(chip, 0);
+	OPL_envelope_kernel(chip, OPL_LANES);
+	OPL_phase_kernel(chip, 0);
+	OPL_phase_kernel(chip, OPL_LANES);
+
+	int channels = chip->opl3 ? OPL_CHANNELS : 9;
+
+	// modulators, with feedback
+	for (int i = 0; i < channels; ++i) {
+		int32 feedback = chip->feedback[i];
+		if (chip->rhythm && (i == 7 || i == 8)) {
+			feedback = 0;
+		}
+		chip->mod[i] = feedback ? (chip->prev_out[i] + chip->out[i]) >> (9 - feedback) : 0;
+		chip->prev_out[i] = chip->out[i];
+	}
+	OPL_operator_kernel(chip, 0, am);
+
+	// carriers, modulated unless the channel is additive
+	for (int i = 0; i < channels; ++i) {
+		chip->mod[OPL_LANES + i] = chip->additive[i] ? 0 : chip->out[i];
+	}
+	OPL_operator_kernel(chip, OPL_LANES, am);
+
+	*left = 0;
+	*right = 0;
+	for (int i = 0; i < channels; ++i) {
+		if (chip->rhythm && i >= 6 && i <= 8) {
+			continue;
+		}
+		int32 out = chip->out[OPL_LANES + i];
+		if (chip->additive[i]) {
+			out += chip->out[i];
+		}
+		OPL_mix(chip, i, out, left, right);
+	}
+	if (chip->rhythm) {
+		OPL_rhythm(chip, am, left, right);
+	}
+}
+
+void OPL_generate(OPL_Chip *chip, int16 *buffer, uint32 samples) {
+	for (uint32 n = 0; n < samples; ++n) {
+		int32 left, right;
+		OPL_sample(chip, &left, &right);
+		buffer[n] = OPL_clip((left + right) >> 1);
+	}
+}
+
+void OPL_generate_stereo(OPL_Chip *chip, int16 *buffer, uint32 samples) {
+	for (uint32 n = 0; n < samples; ++n) {
+		int32 left, right;
+		OPL_sample(chip, &left, &right);
+		buffer[2 * n] = OPL_clip(left);
+		buffer[2 * n + 1] = OPL_clip(right);
+	}
+}
+
+
+/**********************************
+	setup
+*/
+
+void OPL_reset(OPL_Chip *chip) {
+	uint32 rate = chip->rate;
+	memset(chip, 0, sizeof(OPL_Chip));
+
+	chip->rate = rate;
+	chip->step_scale = (float)OPL_NATIVE_RATE / rate;
+	chip->freq_scale = (uint32)(((uint64)OPL_NATIVE_RATE << 16) / rate);
+	chip->am_inc = (uint32)(3.7 / rate * 4294967296.0);
+	chip->vib_inc = (uint32)(6.1 / rate * 4294967296.0);
+	chip->noise = 1;
+	chip->lanes = OPL2_LANES;
+
+	for (int i = 0; i < OPL_SLOTS; ++i) {
+		chip->env[i] = MAX_ATTENUATION;
+		chip->env_state[i] = kEnvOff;
+		chip->attack_mul[i] = 1.0f;
+		chip->sustain_level[i] = MAX_ATTENUATION;
+		chip->base_level[i] = MAX_ATTENUATION;	// keeps the padding lanes silent
+	}
+	for (int i = 0; i < OPL_CHANNELS; ++i) {
+		OPL_update_slot(chip, i, 0);
+		OPL_update_slot(chip, i, 1);
+		OPL_update_channel(chip, i);
+	}
+}
+
+OPL_Chip *OPL_create(uint32 rate) {
+	OPL_tables();
+
+	OPL_Chip *chip = new OPL_Chip;
+	chip->rate = rate;
+	OPL_reset(chip);
+	return chip;
+}
+
+void OPL_destroy(OPL_Chip *chip) {
+	delete chip;
+}
+
+void OPL_copy(OPL_Chip *to, const OPL_Chip *from) {
+	memcpy(to, from, sizeof(OPL_Chip));
+}
+
+/* The LFOs and the noise generator run freely and are left out, as are the phases of silent
+   operators, which a key on resets (except the two that the hi-hat and the cymbal share). */
+bool OPL_same_state(const OPL_Chip *a, const OPL_Chip *b) {
+	if (memcmp(a->regs, b->regs, sizeof(a->regs)) != 0) {
+		return false;
+	}
+	for (int i = 0; i < OPL_SLOTS; ++i) {
+		if (a->env_state[i] != b->env_state[i] || a->env[i] != b->env[i] || a->key[i] != b->key[i] ||
+			a->out[i] != b->out[i] || a->prev_out[i] != b->prev_out[i]) {
+			return false;
+		}
+		bool shared = a->rhythm && (i == OPL_SLOT(7, 0) || i == OPL_SLOT(8, 1));
+		if ((a->env_state[i] != kEnvOff || shared) && a->phase[i] != b->phase[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**********************************
+	driver backend
+*/
+
+OplEmulator::OplEmulator(uint32 rate) : rate(rate), timer_clock(0), quarter_us(0), division(0) {
+	chip = OPL_create(rate);
+	reset();
+}
+
+OplEmulator::~OplEmulator() {
+	OPL_destroy(chip);
+}
+
+void OplEmulator::reset() {
+	OPL_reset(chip);
+	pending.clear();
+	pending_head = 0;
+	tick_sample = 0;
+	rendered = 0;
+	tick_fraction = 0;
+	update_period();
+	fraction_unit = tick_unit;
+}
+
+void OplEmulator::write(const OplWrite *writes, uint16 count) {
+	for (int i = 0; i < count; ++i) {
+		PendingWrite write = { tick_sample, writes[i].command, writes[i].value };
+		pending.push_back(write);
+	}
+}
+
+void OplEmulator::set_timer(uint16 clock) {
+	timer_clock = clock;
+	quarter_us = 0;
+	update_period();
+}
+
+void OplEmulator::set_tick_period(uint32 quarter_us, uint16 division) {
+	this->quarter_us = division ? quarter_us : 0;
+	this->division = division;
+	update_period();
+}
+
+void OplEmulator::reset_timer() {
+}
+
+void OplEmulator::update_period() {
+	if (quarter_us != 0) {
+		tick_samples = (uint64)rate * quarter_us;
+		tick_unit = (uint64)division * 1000000;
+	} else {
+		tick_samples = rate;
+		tick_unit = timer_clock ? timer_clock : 1;
+	}
+}
+
+void OplEmulator::next_ticks(uint32 ticks) {
+	if (fraction_unit != tick_unit) {
+		// the tempo changed: the same part of a sample, in the new unit
+		tick_fraction = (tick_fraction * tick_unit + fraction_unit / 2) / fraction_unit;
+		if (tick_fraction >= tick_unit) {
+			tick_fraction = tick_unit - 1;
+		}
+		fraction_unit = tick_unit;
+	}
+	while (ticks > 0) {
+		uint32 n = ticks < 65536 ? ticks : 65536;	// keeps the product in 64 bits
+		tick_fraction += tick_samples * n;
+		tick_sample += tick_fraction / tick_unit;
+		tick_fraction %= tick_unit;
+		ticks -= n;
+	}
+}
+
+uint32 OplEmulator::ready() {
+	uint64 samples = tick_sample > rendered ? tick_sample - rendered : 0;
+	return samples < 0xFFFFFFFF ? (uint32)samples : 0xFFFFFFFF;
+}
+
+void OplEmulator::render(int16 *buffer, uint32 samples, bool stereo) {
+	while (true) {
+		while (pending_head < pending.size() && pending[pending_head].sample <= rendered) {
+			OPL_write(chip, pending[pending_head].command, pending[pending_head].value);
+			pending_head++;
+		}
+		if (samples == 0) {
+			break;
+		}
+
+		// up to the next write
+		uint32 n = samples;
+		if (pending_head < pending.size() && pending[pending_head].sample - rendered < n) {
+			n = (uint32)(pending[pending_head].sample - rendered);
+		}
+		if (stereo) {
+			OPL_generate_stereo(chip, buffer, n);
+			buffer += 2 * n;
+		} else {
+			OPL_generate(chip, buffer, n);
+			buffer += n;
+		}
+		rendered += n;
+		samples -= n;
+	}
+
+	// the writes left are those of the ticks ahead
+	pending.erase(pending.begin(), pending.begin() + pending_head);
+	pending_head = 0;
+}
@@ -0,0 +1,77 @@
+#ifndef OPL_H
+#define OPL_H
+
+#include "adlib.h"
+
+/**********************************
+	software OPL2 (YM3812) / OPL3 (YMF262)
+
+	Operators are stored as structure of arrays so that the envelope, phase and
+	waveform kernels run over all of them at once (AVX2 or SSE2 when the
+	compiler targets them, plain C otherwise). The second register bank of the
+	OPL3 is at 0x100-0x1FF and plays once bit 0 of 0x105 is set. Only 2-operator
+	channels are emulated: 0x104 is ignored.
+*/
+
+#define OPL_NATIVE_RATE		49716	// the chip's own sample rate (3.58 MHz / 72)
+
+struct OPL_Chip;
+
+OPL_Chip *OPL_create(uint32 rate);
+void OPL_destroy(OPL_Chip *chip);
+void OPL_reset(OPL_Chip *chip);
+void OPL_write(OPL_Chip *chip, uint16 reg, uint8 value);
+void OPL_generate(OPL_Chip *chip, int16 *buffer, uint32 samples);		// both sides mixed
+void OPL_generate_stereo(OPL_Chip *chip, int16 *buffer, uint32 samples);	// interleaved left, right
+void OPL_copy(OPL_Chip *to, const OPL_Chip *from);
+bool OPL_same_state(const OPL_Chip *a, const OPL_Chip *b);	// both will play the same from here on
+
+/* driver backend rendering to an emulated chip, on a virtual clock. Every write is stamped with the
+   sample position of its tick and only reaches the chip when render() gets to that sample, so the
+   host can run the driver ahead for a whole block and still have each write land on its exact
+   sample. The host calls next_ticks() for the ticks the driver ran. Their length comes from
+   set_tick_period() (set_timer() alone only gives whole Hz) and the part of a sample left over is
+   carried from tick to tick, so the timing neither drifts nor jitters. */
+class OplEmulator : public AdlibBackend {
+public:
+	OplEmulator(uint32 rate);
+	~OplEmulator();
+
+	void write(const OplWrite *writes, uint16 count);
+	void set_timer(uint16 clock);
+	void set_tick_period(uint32 quarter_us, uint16 division);
+	void reset_timer();
+
+	void reset();		// the chip, the clock and the pending writes
+	void next_ticks(uint32 ticks);
+	uint32 ready();		// samples up to the tick to come, all of whose writes are known
+	void render(int16 *buffer, uint32 samples, bool stereo);	// interleaved if stereo, 0 samples applies the writes due
+
+	OPL_Chip *chip;
+	uint32 rate;
+	uint16 timer_clock;
+	uint32 quarter_us;		// 0 if the ticks follow timer_clock
+	uint16 division;
+	uint64 tick_sample;		// where the writes of the tick to come land
+	uint64 rendered;		// samples made so far
+
+private:
+	struct PendingWrite {
+		uint64 sample;
+		uint16 command;
+		uint8 value;
+	};
+
+	std::vector<PendingWrite> pending;
+	uint32 pending_head;	// next one to apply
+
+	// a tick lasts tick_samples / tick_unit samples, tick_fraction / tick_unit is carried over
+	uint64 tick_samples;
+	uint64 tick_unit;
+	uint64 tick_fraction;
+	uint64 fraction_unit;	// of tick_fraction, until the next tick rescales it to tick_unit
+
+	void update_period();
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "loadfile.h"
+#include "songarchive.h"
+
+/**********************************
+	archive packer
+
+	Puts songs into one archive for render -a. Each song is named after its
+	file, without the directory and the extension.
+
+	usage: pack out.msa song ...
+*/
+
+void write_le(uint8 *p, uint32 value, int bytes) {
+	for (int i = 0; i < bytes; ++i) {
+		p[i] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s out.msa song ...\n", argv[0]);
+		return 1;
+	}
+
+	uint32 count = argc - 2;
+	std::vector<uint8> archive(ARCHIVE_HEADER_SIZE + count * sizeof(ArchiveEntry), 0);
+	memcpy(&archive[0], "MSCA", 4);
+	write_le(&archive[4], ARCHIVE_VERSION, 4);
+	write_le(&archive[8], count, 4);
+
+	for (uint32 i = 0; i < count; ++i) {
+		const char *path = argv[i + 2];
+		std::vector<uint8> song;
+		if (!load_file(path, song) || song.size() < 7) {
+			fprintf(stderr, "cannot load %s\n", path);
+			return 1;
+		}
+
+		std::string name = path;
+		name = name.substr(name.find_last_of('/') + 1);
+		name = name.substr(0, name.find_last_of('.'));
+		if (name.size() >= ARCHIVE_NAME_SIZE) {
+			fprintf(stderr, "%s: name longer than %d characters\n", path, ARCHIVE_NAME_SIZE - 1);
+			return 1;
+		}
+
+		archive.resize((archive.size() + ARCHIVE_ALIGN - 1) & ~(ARCHIVE_ALIGN - 1), 0);
+
+		ArchiveEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		strcpy(entry.name, name.c_str());
+		entry.offset = archive.size();
+		entry.length = song.size();
+		if (song.size() >= 14 && memcmp(&song[0], "MThd", 4) == 0) {
+			// standard MIDI file: the tempo comes with the first tempo event
+			entry.tempo = 120;
+			entry.division = (song[12] << 8) | song[13];
+		} else {
+			entry.tempo = song[4];
+			entry.division = song[5] | (song[6] << 8);
+		}
+		memcpy(&archive[ARCHIVE_HEADER_SIZE + i * sizeof(ArchiveEntry)], &entry, sizeof(entry));
+
+		archive.insert(archive.end(), song.begin(), song.end());
+	}
+
+	FILE *f = fopen(argv[1], "wb");
+	if (!f || fwrite(&archive[0], 1, archive.size(), f) != archive.size()) {
+		fprintf(stderr, "cannot write %s\n", argv[1]);
+		if (f) {
+			fclose(f);
+		}
+		return 1;
+	}
+	fclose(f);
+	printf("%s: %u songs, %u bytes\n", argv[1], count, (uint32)archive.size());
+	return 0;
+}
@@ -0,0 +1,252 @@
+#include <memory.h>
+
+#include "regstream.h"
+
+/**********************************
+	compiler
+*/
+
+// turns what the driver sends to the chip into the byte code
+class RegStreamRecorder : public AdlibBackend {
+public:
+	RegStreamRecorder(std::vector<uint8> &out) : out(out), tick(0), last_tick(0), bank(0), clock(0) {}
+
+	void write(const OplWrite *writes, uint16 count) {
+		sync();
+		for (int i = 0; i < count; ++i) {
+			uint16 bank_needed = writes[i].command & 0x100;
+			if (bank_needed != bank) {
+				out.push_back(bank_needed ? REGSTREAM_BANK1 : REGSTREAM_BANK0);
+				bank = bank_needed;
+			}
+			out.push_back(writes[i].command & 0xFF);
+			out.push_back(writes[i].value);
+		}
+	}
+
+	// the driver always follows set_timer() with set_tick_period(), which writes both
+	void set_timer(uint16 clock) {
+		this->clock = clock;
+	}
+
+	void set_tick_period(uint32 quarter_us, uint16 division) {
+		sync();
+		out.push_back(REGSTREAM_TIMER);
+		out.push_back(clock & 0xFF);
+		out.push_back(clock >> 8);
+		for (int i = 0; i < 3; ++i) {
+			out.push_back((quarter_us >> (8 * i)) & 0xFF);
+		}
+		out.push_back(division & 0xFF);
+		out.push_back(division >> 8);
+	}
+
+	void reset_timer() {}	// the player does it when the stream ends
+
+	// the ticks since the last op, as a single wait
+	void sync() {
+		uint32 delta = tick - last_tick;
+		if (delta == 0) {
+			return;
+		}
+		if (delta <= REGSTREAM_WAIT_SHORT_MAX) {
+			out.push_back(REGSTREAM_WAIT_SHORT + delta - 1);
+		} else {
+			out.push_back(REGSTREAM_WAIT);
+			uint8 bytes[5];
+			int n = 0;
+			do {
+				bytes[n++] = delta & 0x7F;
+				delta >>= 7;
+			} while (delta != 0);
+			while (n > 1) {
+				out.push_back(bytes[--n] | 0x80);
+			}
+			out.push_back(bytes[0]);
+		}
+		last_tick = tick;
+	}
+
+	std::vector<uint8> &out;
+	uint32 tick;		// of the driver, 0 before the first midi_driver() call
+	uint32 last_tick;	// of the last op written
+	uint16 bank;
+	uint16 clock;		// of the last set_timer()
+};
+
+bool regstream_compile(const uint8 *song, uint32 size, bool opl3, std::vector<uint8> &out) {
+	out.assign(REGSTREAM_HEADER_SIZE, 0);
+	memcpy(&out[0], "MSCO", 4);
+	out[4] = REGSTREAM_VERSION;
+	out[5] = opl3 ? REGSTREAM_FLAG_OPL3 : 0;
+
+	RegStreamRecorder recorder(out);
+	AdlibDriver *driver = new AdlibDriver(&recorder, opl3);
+	driver->midi_init();
+	driver->driver_installed = true;
+	driver->midi_buffer = song;
+	driver->midi_buffer_size = size;
+	driver->midi_resume();
+
+	bool played = driver->driver_status == kStatusPlaying;
+	while (driver->driver_status == kStatusPlaying) {
+		uint32 ticks = driver->midi_advance(driver->midi_idle_ticks());
+		recorder.tick += ticks;
+		if (ticks == 0) {
+			recorder.tick++;
+			driver->midi_driver();
+		}
+	}
+	delete driver;
+
+	recorder.sync();
+	out.push_back(REGSTREAM_END);
+	for (int i = 0; i < 4; ++i) {
+		out[8 + i] = (recorder.tick >> (8 * i)) & 0xFF;
+	}
+	return played;
+}
+
+bool regstream_is_stream(const uint8 *data, uint32 size) {
+	return size > REGSTREAM_HEADER_SIZE && memcmp(data, "MSCO", 4) == 0 && data[4] == REGSTREAM_VERSION;
+}
+
+
+/**********************************
+	player
+*/
+
+RegStreamPlayer::RegStreamPlayer(AdlibBackend *backend) :
+	playing(false),
+	loop(false),
+	opl3(false),
+	position(0),
+	length(0),
+	backend(backend),
+	data(0),
+	size(0),
+	queue_len(0) {
+}
+
+bool RegStreamPlayer::open(const uint8 *data, uint32 size) {
+	playing = false;
+	if (!regstream_is_stream(data, size)) {
+		return false;
+	}
+	this->data = data;
+	this->size = size;
+	opl3 = (data[5] & REGSTREAM_FLAG_OPL3) != 0;
+	length = data[8] | (data[9] << 8) | (data[10] << 16) | ((uint32)data[11] << 24);
+
+	pos = REGSTREAM_HEADER_SIZE;
+	bank = 0;
+	position = 0;
+	playing = true;
+	run_frame();
+	return true;
+}
+
+/* runs the ops up to the next wait */
+void RegStreamPlayer::run_frame() {
+	wait = 0;
+
+	while (wait == 0) {
+		uint8 op = pos < size ? data[pos++] : REGSTREAM_END;
+
+		if (op < REGSTREAM_WAIT_SHORT) {
+			if (pos >= size) {
+				pos = size;
+				continue;	// truncated
+			}
+			write(bank | op, data[pos++]);
+			continue;
+		}
+
+		switch (op) {
+		case REGSTREAM_BANK0:
+			bank = 0;
+			break;
+		case REGSTREAM_BANK1:
+			bank = 0x100;
+			break;
+		case REGSTREAM_TIMER:
+			flush();
+			if (pos + 7 <= size) {
+				backend->set_timer(data[pos] | (data[pos + 1] << 8));
+				backend->set_tick_period(data[pos + 2] | (data[pos + 3] << 8) | (data[pos + 4] << 16), data[pos + 5] | (data[pos + 6] << 8));
+			}
+			pos += 7;
+			break;
+		case REGSTREAM_WAIT: {
+			uint32 ticks = 0;
+			uint8 b;
+			do {
+				b = pos < size ? data[pos++] : 0;
+				ticks = (ticks << 7) | (b & 0x7F);
+			} while (b & 0x80);
+			wait = ticks ? ticks : 1;
+			break;
+		}
+		case REGSTREAM_END:
+			flush();
+			if (loop && length != 0) {
+				// from the top, where the chip is set up again
+				pos = REGSTREAM_HEADER_SIZE;
+				bank = 0;
+				position = 0;
+				break;
+			}
+			backend->reset_timer();
+			playing = false;
+			return;
+		default:
+			wait = op - REGSTREAM_WAIT_SHORT + 1;
+			break;
+		}
+	}
+
+	flush();
+}
+
+void RegStreamPlayer::tick() {
+	if (!playing) {
+		return;
+	}
+	position++;
+	if (--wait == 0) {
+		run_frame();
+	}
+}
+
+uint32 RegStreamPlayer::idle_ticks() {
+	return playing ? wait - 1 : 0xFFFFFFFF;
+}
+
+uint32 RegStreamPlayer::advance(uint32 ticks) {
+	if (!playing) {
+		return 0;
+	}
+	if (ticks > wait - 1) {
+		ticks = wait - 1;
+	}
+	wait -= ticks;
+	position += ticks;
+	return ticks;
+}
+
+void RegStreamPlayer::write(uint16 command, uint8 value) {
+	if (queue_len == sizeof(queue) / sizeof(queue[0])) {
+		flush();
+	}
+	OplWrite *write = &queue[queue_len++];
+	write->tick = position;
+	write->command = command;
+	write->value = value;
+}
+
+void RegStreamPlayer::flush() {
+	if (queue_len != 0) {
+		backend->write(queue, queue_len);
+		queue_len = 0;
+	}
+}
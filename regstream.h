@@ -0,0 +1,74 @@
+#ifndef REGSTREAM_H
+#define REGSTREAM_H
+
+#include <vector>
+
+#include "adlib.h"
+
+/**********************************
+	compiled register streams
+
+	A song played once through the driver offline, kept as the register writes
+	and timer changes it caused, tick by tick. Playing it back needs no parsing,
+	voice allocation or level math: a tick is a pointer bump and the writes that
+	belong to it, and tempo changes are already timer changes.
+
+	header:	"MSCO", version, flags (bit 0: OPL3), 2 bytes unused,
+			length in ticks (32 bit little endian)
+	body:	a byte code. The first byte of an op is either a register of the
+			current bank (0x00-0xF5), followed by the value to write, or:
+*/
+
+#define REGSTREAM_HEADER_SIZE	12
+#define REGSTREAM_VERSION		2
+#define REGSTREAM_FLAG_OPL3		0x01
+
+#define REGSTREAM_WAIT_SHORT	0xF6	// 0xF6-0xFA: wait 1-5 ticks
+#define REGSTREAM_WAIT_SHORT_MAX	5
+#define REGSTREAM_BANK1			0xFB	// writes go to 0x100-0x1FF from now on
+#define REGSTREAM_BANK0			0xFC	// and back to 0x000-0x0FF
+#define REGSTREAM_TIMER			0xFD	// set_timer() and set_tick_period(): clock (16 bit), quarter_us (24 bit),
+										// division (16 bit), little endian
+#define REGSTREAM_WAIT			0xFE	// wait n ticks, n as a VLQ
+#define REGSTREAM_END			0xFF	// the song stopped on this tick
+
+/* plays song through a driver into a stream, until the song stops. Returns false if the song does not
+   play at all. */
+bool regstream_compile(const uint8 *song, uint32 size, bool opl3, std::vector<uint8> &out);
+
+bool regstream_is_stream(const uint8 *data, uint32 size);
+
+/* Plays a compiled stream in place: the data is neither copied nor modified, so it can be a mapped
+   file shared by any number of players. Ticks follow the same rules as AdlibDriver::midi_driver(). */
+class RegStreamPlayer {
+public:
+	RegStreamPlayer(AdlibBackend *backend);
+
+	bool open(const uint8 *data, uint32 size);	// runs the writes that come before the first tick
+	void tick();
+	uint32 idle_ticks();			// upcoming ticks with nothing to write, 0xFFFFFFFF if not playing
+	uint32 advance(uint32 ticks);	// skips up to idle_ticks() at once
+
+	bool playing;
+	bool loop;			// start over at the end, instead of stopping
+	bool opl3;
+	uint32 position;	// in ticks
+	uint32 length;
+
+private:
+	void run_frame();
+	void write(uint16 command, uint8 value);
+	void flush();
+
+	AdlibBackend *backend;
+	const uint8 *data;
+	uint32 size;
+	uint32 pos;			// next op
+	uint32 wait;		// ticks until the next frame of writes
+	uint16 bank;
+
+	OplWrite queue[64];
+	uint16 queue_len;
+};
+
+#endif
@@ -0,0 +1,682 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "adlib.h"
+#include "loadfile.h"
+#include "loopcache.h"
+#include "opl.h"
+#include "regstream.h"
+#include "songarchive.h"
+#include "trace.h"
+
+/**********************************
+	headless renderer
+
+	Plays songs through the driver on a virtual clock and writes the output
+	of the emulated chip to WAV files, as fast as the CPU allows.
+
+	usage: render [-3] [-S] [-r rate] [-t tail_ms] [-s start_tick] [-L loop_ms] [-T trace.json] [-a archive] song out.wav
+	       render -b [-j threads] [-3] [-S] [-r rate] [-t tail_ms] [-T trace.json] outdir song|dir|@list ...
+	       render -b -a archive [-j threads] [-3] [-r rate] [-t tail_ms] [-T trace.json] outdir [song ...]
+	       render -i song ...
+
+	-3 plays on an OPL3 with 15 melodic voices and writes stereo files.
+	Songs compiled with the compile tool play without the driver.
+	-S streams song files through the driver in chunks instead of loading
+	them whole (no seeking then).
+	-a plays songs from an archive made by pack: the songs are then given by
+	name (all of them in batch mode if none is given) and play straight from
+	the mapped file.
+	-L loops the song for loop_ms, playing the loops from a PCM cache once
+	one has been verified to repeat exactly.
+	-i prints the length, tempo changes, peak polyphony, programs and drums
+	of songs without playing them.
+	-T writes the trace records as Chrome trace JSON at the end, when the
+	driver is built with -DADLIB_TRACE.
+*/
+
+#define DEFAULT_RATE		44100
+#define DEFAULT_TAIL_MS		1000
+#define RENDER_BLOCK		4096
+
+typedef std::chrono::steady_clock Clock;
+
+void write_le(uint8 *p, uint32 value, int bytes) {
+	for (int i = 0; i < bytes; ++i) {
+		p[i] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+void write_wav_header(FILE *f, uint32 rate, uint32 channels, uint32 samples) {
+	uint8 header[44];
+	uint32 data_size = samples * channels * 2;
+	memcpy(header, "RIFF", 4);
+	write_le(header + 4, 36 + data_size, 4);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	write_le(header + 16, 16, 4);		// fmt chunk size
+	write_le(header + 20, 1, 2);		// PCM
+	write_le(header + 22, channels, 2);
+	write_le(header + 24, rate, 4);
+	write_le(header + 28, rate * channels * 2, 4);	// byte rate
+	write_le(header + 32, channels * 2, 2);		// block align
+	write_le(header + 34, 16, 2);		// bits per sample
+	memcpy(header + 36, "data", 4);
+	write_le(header + 40, data_size, 4);
+	fwrite(header, 1, sizeof(header), f);
+}
+
+
+/**********************************
+	song rendering
+*/
+
+/* reads a song file in chunks, for -S */
+class FileSource : public AdlibSongSource {
+public:
+	FileSource() : f(0) {}
+	~FileSource() {
+		close();
+	}
+
+	bool open(const char *path) {
+		close();
+		f = fopen(path, "rb");
+		return f != 0;
+	}
+	void close() {
+		if (f) {
+			fclose(f);
+			f = 0;
+		}
+	}
+
+	uint32 refill(uint8 *buffer, uint32 size) {
+		return fread(buffer, 1, size, f);
+	}
+	bool rewind() {
+		return fseek(f, 0, SEEK_SET) == 0;
+	}
+	uint32 read(uint32 offset, uint8 *buffer, uint32 size) {
+		if (fseek(f, offset, SEEK_SET) != 0) {
+			return 0;
+		}
+		return fread(buffer, 1, size, f);
+	}
+
+	FILE *f;
+};
+
+/* everything needed to render a song. Batch workers keep one each and reuse the driver, the chip
+   and the buffers from one song to the next. */
+struct Renderer {
+	OplEmulator opl;
+	AdlibDriver driver;
+	RegStreamPlayer player;		// for compiled songs
+	LoopCache cache;			// for -L
+	FileSource source;			// for streamed songs
+	bool stream;
+	uint32 rate;
+	uint32 tail_ms;
+	uint32 channels;	// 2 on OPL3
+	uint32 start_tick;	// where playback starts, in driver ticks
+	uint32 loop_ms;		// loop the song for that long, 0 to play it once
+	bool looping;
+
+	std::vector<uint8> song;
+	int16 block[RENDER_BLOCK * 2];	// rendered in one go once the driver has run past its end
+	uint8 bytes[RENDER_BLOCK * 4];
+	uint32 block_fill;		// in sample frames
+	uint32 total_samples;
+	FILE *out;
+
+	Renderer(uint32 rate, uint32 tail_ms, bool opl3) : opl(rate), driver(&opl, opl3), player(&opl), cache(&opl, &driver, opl3), stream(false), rate(rate), tail_ms(tail_ms), channels(opl3 ? 2 : 1), start_tick(0), loop_ms(0), looping(false) {
+	}
+};
+
+void flush_block(Renderer *r) {
+	uint32 count = r->block_fill * r->channels;
+	for (uint32 i = 0; i < count; ++i) {
+		write_le(&r->bytes[2 * i], (uint16)r->block[i], 2);
+	}
+	fwrite(r->bytes, 2, count, r->out);
+	r->block_fill = 0;
+}
+
+void render_samples(Renderer *r, uint32 count) {
+	while (count > 0) {
+		uint32 n = RENDER_BLOCK - r->block_fill;
+		if (n > count) {
+			n = count;
+		}
+		if (r->looping) {
+			r->cache.render(&r->block[r->channels * r->block_fill], n);
+		} else {
+			r->opl.render(&r->block[r->channels * r->block_fill], n, r->channels == 2);
+		}
+		r->block_fill += n;
+		r->total_samples += n;
+		count -= n;
+
+		if (r->block_fill == RENDER_BLOCK) {
+			flush_block(r);
+		}
+	}
+}
+
+/* renders one song to a WAV file. The song data is played where it is, or streamed from source if
+   there is one. Returns the length of the audio in seconds, or -1 on error. */
+double render_song(Renderer *r, const char *song_path, const uint8 *song, uint32 size, AdlibSongSource *source, const char *wav_path) {
+	if (!source && (!song || size < 10)) {
+		fprintf(stderr, "cannot load %s\n", song_path);
+		return -1;
+	}
+	bool compiled = !source && regstream_is_stream(song, size);
+	if (compiled && ((song[5] & REGSTREAM_FLAG_OPL3) != 0) != (r->channels == 2)) {
+		fprintf(stderr, "%s: compiled for %s\n", song_path, r->channels == 2 ? "OPL2, render without -3" : "OPL3, render with -3");
+		return -1;
+	}
+
+	r->out = fopen(wav_path, "wb");
+	if (!r->out) {
+		fprintf(stderr, "cannot create %s\n", wav_path);
+		return -1;
+	}
+	write_wav_header(r->out, r->rate, r->channels, 0);
+
+	r->opl.reset();
+	r->block_fill = 0;
+	r->total_samples = 0;
+
+	AdlibDriver &driver = r->driver;
+	RegStreamPlayer &player = r->player;
+	if (compiled) {
+		player.open(song, size);
+		if (r->start_tick != 0) {
+			fprintf(stderr, "%s: cannot seek in a compiled song\n", song_path);
+		}
+	} else {
+		driver.midi_init();
+		driver.driver_installed = true;
+		driver.midi_buffer = song;
+		driver.midi_buffer_size = size;
+		driver.midi_set_source(source);
+		driver.midi_loop = r->loop_ms != 0;
+		driver.midi_resume();
+		if (r->start_tick != 0 && !driver.midi_seek(r->start_tick)) {
+			fprintf(stderr, "%s: cannot seek to tick %u\n", song_path, r->start_tick);
+		}
+	}
+
+	if (r->loop_ms != 0 && !compiled) {
+		// for loop_ms exactly, the song does not end
+		r->looping = true;
+		r->cache.start();
+		render_samples(r, (uint64)r->rate * r->loop_ms / 1000);
+		r->looping = false;
+		if (r->cache.cached) {
+			printf("%s: loops of %.2f s played from the cache\n", song_path, (double)r->cache.loop_samples / r->rate);
+		}
+	} else {
+		while (compiled ? player.playing : driver.driver_status == kStatusPlaying) {
+			// the writes of the ticks run so far land on their own samples, whatever the block size
+			if (r->opl.ready() >= RENDER_BLOCK) {
+				render_samples(r, RENDER_BLOCK);
+				continue;
+			}
+
+			// skip the ticks with nothing to do in one go
+			uint32 ticks;
+			if (compiled) {
+				ticks = player.advance(player.idle_ticks());
+				if (ticks == 0) {
+					player.tick();
+					ticks = 1;
+				}
+			} else {
+				ticks = driver.midi_advance(driver.midi_idle_ticks());
+				if (ticks == 0) {
+					driver.midi_driver();
+					ticks = 1;
+				}
+			}
+			r->opl.next_ticks(ticks);
+		}
+		render_samples(r, r->opl.ready());
+
+		// let the notes ring out
+		render_samples(r, (uint64)r->rate * r->tail_ms / 1000);
+	}
+	flush_block(r);
+
+	fseek(r->out, 0, SEEK_SET);
+	write_wav_header(r->out, r->rate, r->channels, r->total_samples);
+	fclose(r->out);
+
+	return (double)r->total_samples / r->rate;
+}
+
+
+/* renders a song from the archive if there is one, else from a file, loaded into the renderer or
+   streamed */
+double render_path(Renderer *r, SongArchive *archive, const char *path, const char *wav_path) {
+	uint32 size = 0;
+	const uint8 *song = 0;
+
+	if (archive) {
+		song = archive_song(archive, archive_find(archive, path), &size);
+	} else if (r->stream) {
+		if (!r->source.open(path)) {
+			fprintf(stderr, "cannot load %s\n", path);
+			return -1;
+		}
+		double seconds = render_song(r, path, 0, 0, &r->source, wav_path);
+		r->source.close();
+		return seconds;
+	} else if (load_file(path, r->song)) {
+		song = &r->song[0];
+		size = r->song.size();
+	}
+	return render_song(r, path, song, size, 0, wav_path);
+}
+
+
+/**********************************
+	batch mode
+*/
+
+struct BatchSong {
+	std::string path;	// or the name in the archive
+	std::string wav;
+	long size;
+};
+
+/* Songs are dealt to per-worker queues, biggest first. A worker takes from the back of its own
+   queue and, once that is empty, steals from the front of the others, so long songs never leave
+   the other cores idle at the end of a run. */
+struct WorkQueue {
+	std::mutex lock;
+	std::deque<int> jobs;
+};
+
+struct Batch {
+	std::vector<BatchSong> songs;
+	std::vector<WorkQueue> queues;
+	std::set<std::string> wavs;		// no two songs may write the same file
+	uint32 rate;
+	uint32 tail_ms;
+	bool opl3;
+	bool stream;
+	SongArchive *archive;
+
+	std::mutex stats_lock;
+	double audio_seconds;
+	int rendered;
+	int failed;
+};
+
+bool next_job(Batch *batch, int worker, int *job) {
+	int workers = batch->queues.size();
+
+	for (int i = 0; i < workers; ++i) {
+		WorkQueue &queue = batch->queues[(worker + i) % workers];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		if (queue.jobs.empty()) {
+			continue;
+		}
+		if (i == 0) {
+			*job = queue.jobs.back();
+			queue.jobs.pop_back();
+		} else {
+			*job = queue.jobs.front();
+			queue.jobs.pop_front();
+		}
+		return true;
+	}
+	return false;
+}
+
+void batch_worker(Batch *batch, int worker) {
+	Renderer *r = new Renderer(batch->rate, batch->tail_ms, batch->opl3);
+	r->stream = batch->stream;
+	int job;
+
+	while (next_job(batch, worker, &job)) {
+		const BatchSong &song = batch->songs[job];
+
+		Clock::time_point start = Clock::now();
+		double seconds = render_path(r, batch->archive, song.path.c_str(), song.wav.c_str());
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+		std::lock_guard<std::mutex> guard(batch->stats_lock);
+		if (seconds < 0) {
+			batch->failed++;
+			continue;
+		}
+		batch->rendered++;
+		batch->audio_seconds += seconds;
+		printf("%s: %.2f s of audio in %.3f s, %.1fx real time\n", song.path.c_str(), seconds, elapsed, elapsed > 0 ? seconds / elapsed : 0.0);
+	}
+
+	delete r;
+}
+
+bool add_output(Batch *batch, const BatchSong &song) {
+	if (!batch->wavs.insert(song.wav).second) {
+		fprintf(stderr, "%s: another song already renders to %s, skipped\n", song.path.c_str(), song.wav.c_str());
+		return false;
+	}
+	batch->songs.push_back(song);
+	return true;
+}
+
+/* Songs in subdirectories of a directory go to the same subdirectories of outdir, so that songs with
+   the same name in different places do not overwrite each other. */
+void add_song(Batch *batch, const std::string &path, const std::string &outdir, bool nested = false) {
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		fprintf(stderr, "cannot find %s\n", path.c_str());
+		return;
+	}
+
+	std::string name = path.substr(path.find_last_of('/') + 1);
+
+	if (S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(path.c_str());
+		if (!dir) {
+			return;
+		}
+		std::string songdir = outdir;
+		if (nested) {
+			songdir += "/" + name;
+			mkdir(songdir.c_str(), 0777);
+		}
+		std::vector<std::string> names;
+		while (struct dirent *entry = readdir(dir)) {
+			if (entry->d_name[0] != '.') {
+				names.push_back(entry->d_name);
+			}
+		}
+		closedir(dir);
+		std::sort(names.begin(), names.end());
+		for (size_t i = 0; i < names.size(); ++i) {
+			add_song(batch, path + "/" + names[i], songdir, true);
+		}
+		return;
+	}
+
+	name = name.substr(0, name.find_last_of('.'));
+
+	BatchSong song;
+	song.path = path;
+	song.wav = outdir + "/" + name + ".wav";
+	song.size = st.st_size;
+	add_output(batch, song);
+}
+
+void add_list(Batch *batch, const char *list, const std::string &outdir) {
+	FILE *f = fopen(list, "r");
+	if (!f) {
+		fprintf(stderr, "cannot open %s\n", list);
+		return;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0]) {
+			add_song(batch, line, outdir);
+		}
+	}
+	fclose(f);
+}
+
+void add_archive_song(Batch *batch, int index, const std::string &outdir) {
+	const ArchiveEntry *entry = &batch->archive->entries[index];
+	BatchSong song;
+	song.path = entry->name;
+	song.wav = outdir + "/" + entry->name + ".wav";
+	song.size = entry->length;
+	add_output(batch, song);
+}
+
+bool larger_song(const BatchSong &a, const BatchSong &b) {
+	return a.size > b.size;
+}
+
+int render_batch(uint32 rate, uint32 tail_ms, bool opl3, bool stream, SongArchive *archive, int threads, const char *outdir, int count, char **paths) {
+	Batch batch;
+	batch.rate = rate;
+	batch.tail_ms = tail_ms;
+	batch.opl3 = opl3;
+	batch.stream = stream;
+	batch.archive = archive;
+	batch.audio_seconds = 0;
+	batch.rendered = 0;
+	batch.failed = 0;
+
+	if (archive && count == 0) {
+		for (uint32 i = 0; i < archive->count; ++i) {
+			add_archive_song(&batch, i, outdir);
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		if (archive) {
+			int index = archive_find(archive, paths[i]);
+			if (index < 0) {
+				fprintf(stderr, "no song %s in the archive\n", paths[i]);
+				continue;
+			}
+			add_archive_song(&batch, index, outdir);
+		} else if (paths[i][0] == '@') {
+			add_list(&batch, paths[i] + 1, outdir);
+		} else {
+			add_song(&batch, paths[i], outdir);
+		}
+	}
+	if (batch.songs.empty()) {
+		fprintf(stderr, "no songs to render\n");
+		return 1;
+	}
+
+	if (threads <= 0) {
+		threads = std::thread::hardware_concurrency();
+	}
+	if (threads <= 0) {
+		threads = 1;
+	}
+	if (threads > (int)batch.songs.size()) {
+		threads = batch.songs.size();
+	}
+
+	// deal the biggest songs first so that they start early
+	std::stable_sort(batch.songs.begin(), batch.songs.end(), larger_song);
+	batch.queues = std::vector<WorkQueue>(threads);
+	for (size_t i = 0; i < batch.songs.size(); ++i) {
+		batch.queues[i % threads].jobs.push_front(i);
+	}
+
+	Clock::time_point start = Clock::now();
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; ++i) {
+		workers.push_back(std::thread(batch_worker, &batch, i));
+	}
+	for (int i = 0; i < threads; ++i) {
+		workers[i].join();
+	}
+
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	printf("total: %d songs (%d failed), %.2f s of audio in %.3f s on %d threads, %.1fx real time, %.1f songs/s\n",
+		batch.rendered, batch.failed, batch.audio_seconds, elapsed, threads,
+		elapsed > 0 ? batch.audio_seconds / elapsed : 0.0, elapsed > 0 ? batch.rendered / elapsed : 0.0);
+
+	return batch.failed ? 1 : 0;
+}
+
+
+/**********************************
+	song information
+*/
+
+/* prints what the driver's analysis finds in each song, without playing it */
+int print_song_info(int count, char **paths) {
+	OplEmulator opl(DEFAULT_RATE);
+	AdlibDriver *driver = new AdlibDriver(&opl);
+	std::vector<uint8> song;
+	int failed = 0;
+
+	driver->midi_init();
+	for (int i = 0; i < count; ++i) {
+		if (!load_file(paths[i], song) || song.size() < 10 || regstream_is_stream(&song[0], song.size())) {
+			fprintf(stderr, "cannot load %s\n", paths[i]);
+			failed++;
+			continue;
+		}
+		driver->midi_buffer = &song[0];
+		driver->midi_buffer_size = song.size();
+		driver->midi_analyze_song();
+
+		const SongAnalysis &analysis = driver->midi_analysis;
+		printf("%s: %u ticks, %.2f s, peak polyphony %u, %u tempo changes\n", paths[i], analysis.length_ticks,
+			analysis.length_ms / 1000.0, analysis.peak_polyphony, (uint32)analysis.tempo_map.size() - 1);
+		for (int channel = 0; channel < NUM_MIDI_CHANNELS; ++channel) {
+			if (channel == 9) {
+				if (analysis.percussion_notes) {
+					printf("\tchannel 9: drums");
+					for (int key = 0; key < 47; ++key) {
+						if (analysis.percussion_notes & (1ULL << key)) {
+							printf(" %d", key + 35);
+						}
+					}
+					printf("\n");
+				}
+				continue;
+			}
+			bool any = false;
+			for (int program = 0; program < 128; ++program) {
+				if (analysis.programs[channel][program >> 5] & (1 << (program & 31))) {
+					printf(any ? " %d" : "\tchannel %d: programs %d", channel, program);
+					any = true;
+				}
+			}
+			if (any) {
+				printf("\n");
+			}
+		}
+	}
+
+	delete driver;
+	return failed ? 1 : 0;
+}
+
+
+int main(int argc, char **argv) {
+	uint32 rate = DEFAULT_RATE;
+	uint32 tail_ms = DEFAULT_TAIL_MS;
+	bool batch = false;
+	bool info = false;
+	bool opl3 = false;
+	bool stream = false;
+	int threads = 0;
+	uint32 start_tick = 0;
+	uint32 loop_ms = 0;
+	const char *trace_path = 0;
+	const char *archive_path = 0;
+
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+		if (!strcmp(argv[arg], "-r") && arg + 1 < argc) {
+			rate = atoi(argv[++arg]);
+		} else if (!strcmp(argv[arg], "-t") && arg + 1 < argc) {
+			tail_ms = atoi(argv[++arg]);
+		} else if (!strcmp(argv[arg], "-s") && arg + 1 < argc) {
+			start_tick = atoi(argv[++arg]);
+		} else if (!strcmp(argv[arg], "-L") && arg + 1 < argc) {
+			loop_ms = atoi(argv[++arg]);
+		} else if (!strcmp(argv[arg], "-T") && arg + 1 < argc) {
+			trace_path = argv[++arg];
+		} else if (!strcmp(argv[arg], "-a") && arg + 1 < argc) {
+			archive_path = argv[++arg];
+		} else if (!strcmp(argv[arg], "-j") && arg + 1 < argc) {
+			threads = atoi(argv[++arg]);
+		} else if (!strcmp(argv[arg], "-b")) {
+			batch = true;
+		} else if (!strcmp(argv[arg], "-i")) {
+			info = true;
+		} else if (!strcmp(argv[arg], "-3")) {
+			opl3 = true;
+		} else if (!strcmp(argv[arg], "-S")) {
+			stream = true;
+		} else {
+			break;
+		}
+	}
+
+	if (info && arg < argc) {
+		return print_song_info(argc - arg, &argv[arg]);
+	}
+
+	if (rate == 0 || (batch ? argc - arg < (archive_path ? 1 : 2) : argc - arg != 2)) {
+		fprintf(stderr, "usage: %s [-3] [-S] [-r rate] [-t tail_ms] [-s start_tick] [-L loop_ms] [-T trace.json] [-a archive] song out.wav\n", argv[0]);
+		fprintf(stderr, "       %s -b [-j threads] [-3] [-S] [-r rate] [-t tail_ms] [-T trace.json] outdir song|dir|@list ...\n", argv[0]);
+		fprintf(stderr, "       %s -b -a archive [-j threads] [-3] [-r rate] [-t tail_ms] [-T trace.json] outdir [song ...]\n", argv[0]);
+		fprintf(stderr, "       %s -i song ...\n", argv[0]);
+		return 1;
+	}
+
+	SongArchive archive;
+	if (archive_path && !archive_open(&archive, archive_path)) {
+		fprintf(stderr, "cannot open archive %s\n", archive_path);
+		return 1;
+	}
+
+	int result;
+	if (batch) {
+		result = render_batch(rate, tail_ms, opl3, stream, archive_path ? &archive : 0, threads, argv[arg], argc - arg - 1, &argv[arg + 1]);
+	} else {
+		Renderer *r = new Renderer(rate, tail_ms, opl3);
+		r->start_tick = start_tick;
+		r->loop_ms = loop_ms;
+		r->stream = stream;
+
+		Clock::time_point start = Clock::now();
+		double seconds = render_path(r, archive_path ? &archive : 0, argv[arg], argv[arg + 1]);
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		delete r;
+
+		result = seconds < 0 ? 1 : 0;
+		if (seconds >= 0) {
+			printf("%s: %.2f s of audio in %.3f s, %.1fx real time\n", argv[arg], seconds, elapsed, elapsed > 0 ? seconds / elapsed : 0.0);
+		}
+	}
+
+	if (archive_path) {
+		archive_close(&archive);
+	}
+
+	if (trace_path) {
+		FILE *f = fopen(trace_path, "w");
+		if (!f) {
+			fprintf(stderr, "cannot create %s\n", trace_path);
+			return 1;
+		}
+		bool traced = trace_export_chrome(f);
+		fclose(f);
+		if (!traced) {
+			fprintf(stderr, "tracing is not built in, rebuild with -DADLIB_TRACE\n");
+			remove(trace_path);
+			return 1;
+		}
+	}
+	return result;
+}
@@ -0,0 +1,101 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "songarchive.h"
+
+static_assert(sizeof(ArchiveEntry) == 48, "archive entries are 48 bytes on disk");
+
+static uint32 read_le32(const uint8 *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24);
+}
+
+bool archive_open(SongArchive *archive, const char *path) {
+	memset(archive, 0, sizeof(*archive));
+	archive->fd = -1;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < ARCHIVE_HEADER_SIZE || st.st_size > 0xFFFFFFFF) {
+		close(fd);
+		return false;
+	}
+	void *base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	archive->fd = fd;
+	archive->base = (const uint8 *)base;
+	archive->size = st.st_size;
+
+	// only the header and the index are read here
+	const uint8 *header = archive->base;
+	uint32 count = read_le32(header + 8);
+	if (memcmp(header, "MSCA", 4) != 0 || read_le32(header + 4) != ARCHIVE_VERSION ||
+		count > (archive->size - ARCHIVE_HEADER_SIZE) / sizeof(ArchiveEntry)) {
+		archive_close(archive);
+		return false;
+	}
+	archive->count = count;
+	archive->entries = (const ArchiveEntry *)(archive->base + ARCHIVE_HEADER_SIZE);
+	for (uint32 i = 0; i < count; ++i) {
+		const ArchiveEntry *entry = &archive->entries[i];
+		if (entry->offset > archive->size || entry->length > archive->size - entry->offset ||
+			memchr(entry->name, 0, ARCHIVE_NAME_SIZE) == 0) {
+			archive_close(archive);
+			return false;
+		}
+	}
+
+	archive->opened = new std::atomic<uint8>[count ? count : 1];
+	for (uint32 i = 0; i < count; ++i) {
+		archive->opened[i].store(0, std::memory_order_relaxed);
+	}
+	return true;
+}
+
+void archive_close(SongArchive *archive) {
+	if (archive->base) {
+		munmap((void *)archive->base, archive->size);
+	}
+	if (archive->fd >= 0) {
+		close(archive->fd);
+	}
+	delete[] archive->opened;
+	memset(archive, 0, sizeof(*archive));
+	archive->fd = -1;
+}
+
+int archive_find(const SongArchive *archive, const char *name) {
+	for (uint32 i = 0; i < archive->count; ++i) {
+		if (strcmp(archive->entries[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const uint8 *archive_song(SongArchive *archive, int index, uint32 *length) {
+	if (index < 0 || (uint32)index >= archive->count) {
+		return 0;
+	}
+	const ArchiveEntry *entry = &archive->entries[index];
+
+	if (archive->opened[index].exchange(1, std::memory_order_relaxed) == 0) {
+		// read ahead the whole song rather than faulting it in page by page while it plays
+		uintptr_t page = sysconf(_SC_PAGESIZE);
+		uintptr_t start = (uintptr_t)(archive->base + entry->offset) & ~(page - 1);
+		madvise((void *)start, (uintptr_t)(archive->base + entry->offset + entry->length) - start, MADV_WILLNEED);
+	}
+
+	*length = entry->length;
+	return archive->base + entry->offset;
+}
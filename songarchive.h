@@ -0,0 +1,54 @@
+#ifndef SONGARCHIVE_H
+#define SONGARCHIVE_H
+
+#include <atomic>
+
+#include "adlib.h"
+
+/**********************************
+	song archive
+
+	Many songs in one file, with an index up front so that a song can be found
+	and budgeted (tempo, division, size) without touching its data. The file is
+	mapped read only and songs are played straight from the mapping: a song is
+	only read from disk the first time it plays, nothing is copied, and every
+	process that maps the archive shares the same pages of the page cache.
+
+	header:	"MSCA", version, count (32 bit little endian each)
+	index:	count ArchiveEntry
+	data:	the songs, each starting on an ARCHIVE_ALIGN boundary
+*/
+
+#define ARCHIVE_VERSION		1
+#define ARCHIVE_HEADER_SIZE	12
+#define ARCHIVE_NAME_SIZE	32
+#define ARCHIVE_ALIGN		16
+
+// on disk, little endian
+struct ArchiveEntry {
+	char name[ARCHIVE_NAME_SIZE];	// NUL terminated
+	uint32 offset;			// from the start of the file
+	uint32 length;
+	uint16 division;		// from the song header
+	uint8 tempo;
+	uint8 reserved[5];
+};
+
+struct SongArchive {
+	int fd;
+	const uint8 *base;		// the mapping
+	uint32 size;
+	uint32 count;
+	const ArchiveEntry *entries;	// in the mapping
+	std::atomic<uint8> *opened;	// one flag per song, set once it has been played
+};
+
+bool archive_open(SongArchive *archive, const char *path);
+void archive_close(SongArchive *archive);
+int archive_find(const SongArchive *archive, const char *name);	// -1 if absent
+
+/* the song data inside the mapping. The first call for a song asks the kernel to start reading it in.
+   Safe from any thread. */
+const uint8 *archive_song(SongArchive *archive, int index, uint32 *length);
+
+#endif
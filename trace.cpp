@@ -0,0 +1,103 @@
+#include "trace.h"
+
+#ifdef ADLIB_TRACE
+
+#include <atomic>
+#include <chrono>
+
+/* Every slot is a small seqlock, as for the driver snapshot: odd while a writer fills it. A reader
+   that finds it odd or changed skips the record instead of waiting for it. */
+struct TraceSlot {
+	std::atomic<uint32> sequence;
+	std::atomic<uint32> words[4];	// time (2 words), kind | thread << 8 | a << 16, b
+};
+
+static TraceSlot trace_ring[TRACE_RING_SIZE];
+static std::atomic<uint32> trace_head(0);		// records ever claimed
+static std::atomic<uint32> trace_threads(0);
+static thread_local uint32 trace_thread = trace_threads.fetch_add(1, std::memory_order_relaxed);
+static thread_local int trace_suspended = 0;
+static const std::chrono::steady_clock::time_point trace_start = std::chrono::steady_clock::now();
+
+void trace_suspend(int delta) {
+	trace_suspended += delta;
+}
+
+void trace_record(uint8 kind, uint16 a, uint32 b) {
+	if (trace_suspended) {
+		return;
+	}
+	uint64 time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace_start).count();
+	uint32 index = trace_head.fetch_add(1, std::memory_order_relaxed);
+	TraceSlot *slot = &trace_ring[index & (TRACE_RING_SIZE - 1)];
+
+	slot->sequence.store(2 * index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot->words[0].store((uint32)time, std::memory_order_relaxed);
+	slot->words[1].store((uint32)(time >> 32), std::memory_order_relaxed);
+	slot->words[2].store(kind | (trace_thread & 0xFF) << 8 | a << 16, std::memory_order_relaxed);
+	slot->words[3].store(b, std::memory_order_relaxed);
+	slot->sequence.store(2 * index + 2, std::memory_order_release);
+}
+
+static const char *trace_voice_paths[] = { "same note", "free, same program", "free", "same program", "steal" };
+
+bool trace_export_chrome(FILE *f) {
+	uint32 head = trace_head.load(std::memory_order_acquire);
+	uint32 first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	const char *separator = "";
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (uint32 index = first; index != head; ++index) {
+		TraceSlot *slot = &trace_ring[index & (TRACE_RING_SIZE - 1)];
+		uint32 words[4];
+
+		uint32 sequence = slot->sequence.load(std::memory_order_acquire);
+		for (int i = 0; i < 4; ++i) {
+			words[i] = slot->words[i].load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (sequence != 2 * index + 2 || sequence != slot->sequence.load(std::memory_order_relaxed)) {
+			continue;	// being written, or already overwritten
+		}
+
+		double us = (words[0] | (uint64)words[1] << 32) / 1000.0;
+		uint8 kind = words[2] & 0xFF;
+		uint32 thread = (words[2] >> 8) & 0xFF;
+		uint32 a = words[2] >> 16;
+		uint32 b = words[3];
+
+		fprintf(f, "%s{\"pid\":1,\"tid\":%u,\"ts\":%.3f,", separator, thread, us);
+		switch (kind) {
+		case kTraceTickBegin:
+			fprintf(f, "\"ph\":\"B\",\"name\":\"tick\",\"args\":{\"position\":%u}}", b);
+			break;
+		case kTraceTickEnd:
+			fprintf(f, "\"ph\":\"E\",\"name\":\"tick\"}");
+			break;
+		case kTraceEvent:
+			fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"event %02X\",\"args\":{\"data1\":%u,\"data2\":%u}}", a, b & 0xFF, b >> 8);
+			break;
+		case kTraceTempo:
+			fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"tempo\",\"args\":{\"bpm\":%u,\"quarter_us\":%u}}", a, b);
+			break;
+		case kTraceVoice:
+			fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"voice %u\",\"args\":{\"path\":\"%s\"}}", a, b < 5 ? trace_voice_paths[b] : "?");
+			break;
+		default:
+			fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"out\",\"args\":{\"register\":\"0x%03X\",\"value\":\"0x%02X\"}}", a, b);
+			break;
+		}
+		separator = ",\n";
+	}
+	fprintf(f, "\n]}\n");
+	return true;
+}
+
+#else
+
+bool trace_export_chrome(FILE *f) {
+	return false;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#include "adlib.h"
+
+/**********************************
+	trace points
+
+	Built only with -DADLIB_TRACE, in every file. Otherwise ADLIB_TRACE_POINT()
+	expands to nothing and no ring exists.
+
+	Each point stores a fixed size record with a monotonic timestamp in one
+	process wide ring of TRACE_RING_SIZE records. Writers claim a slot with a
+	single atomic increment and never wait, so the ring can stay on in
+	production; once it wraps the oldest records are overwritten.
+	trace_export_chrome() writes what the ring holds as Chrome trace JSON, which
+	Perfetto and chrome://tracing open.
+*/
+
+#define TRACE_RING_SIZE		65536	// power of 2
+
+enum TraceKind {
+	kTraceTickBegin,	// midi_driver(), b: position
+	kTraceTickEnd,		// b: position
+	kTraceEvent,		// song event, a: status, b: data1 | data2 << 8
+	kTraceTempo,		// a: bpm, b: microseconds per quarter note
+	kTraceVoice,		// melodic note on, a: voice, b: TraceVoicePath
+	kTraceWrite			// ADLIB_out(), a: register, b: value
+};
+
+// the allocation step that gave a note its voice, in the order they are tried
+enum TraceVoicePath {
+	kTraceVoiceSameNote,
+	kTraceVoiceFreeSameProgram,
+	kTraceVoiceFree,
+	kTraceVoiceSameProgram,
+	kTraceVoiceSteal
+};
+
+#ifdef ADLIB_TRACE
+void trace_record(uint8 kind, uint16 a, uint32 b);
+void trace_suspend(int delta);
+#define ADLIB_TRACE_POINT(kind, a, b)	trace_record((kind), (a), (b))
+#define ADLIB_TRACE_SUSPEND()			trace_suspend(1)	// nothing is recorded on this thread until ADLIB_TRACE_RESUME()
+#define ADLIB_TRACE_RESUME()			trace_suspend(-1)
+#else
+#define ADLIB_TRACE_POINT(kind, a, b)	((void)0)
+#define ADLIB_TRACE_SUSPEND()			((void)0)
+#define ADLIB_TRACE_RESUME()			((void)0)
+#endif
+
+/* writes the records in the ring, oldest first. Returns false if tracing is not built in. */
+bool trace_export_chrome(FILE *f);
+
+#endif